@@ -20,7 +20,8 @@ int main(){
 	int opt, ret, device = 0;
 	int epoll_fd, nfds = 0;
 
-	fd = open(DEVICE_NAME,O_RDWR);
+	/* Edge triggered: every event is drained until the FIFO is empty */
+	fd = open(DEVICE_NAME,O_RDWR|O_NONBLOCK);
 	if(fd<0)
 		err_handelr(device,"open");
 	epoll_fd = epoll_create(1);
@@ -29,7 +30,7 @@ int main(){
 		close(fd);
 		exit(EXIT_FAILURE);
 	}
-	ev.events = EPOLLPRI;
+	ev.events = EPOLLIN | EPOLLPRI | EPOLLET;
         ev.data.fd = fd;
         nfds = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
         if (nfds == -1) {
@@ -48,8 +49,16 @@ int main(){
                 }
                 for (i = 0; i < nfds; i++) {
                         if (events[i].events & EPOLLPRI)
-                                //nitrox_monitor(ev.data.fd);
-				printf("Event Read\n");
+				printf("FIFO above its high watermark\n");
+                        if (!(events[i].events & (EPOLLIN | EPOLLPRI)))
+                                continue;
+                        while ((ret = read(events[i].data.fd, message, SIZE)) > 0)
+				printf("Read %d bytes: [%.*s]\n", ret, ret, message);
+                        if (ret < 0 && errno != EAGAIN) {
+                                perror("read");
+                                close(fd);
+                                exit(EXIT_FAILURE);
+                        }
                 }
         }	
 	close(fd);
@@ -23,10 +23,11 @@
 #include <linux/cdev.h>
 #include <asm/uaccess.h>
 
+#include "chardev_fifo.h"
+
 #define DRIVE_NAME "char_dev"
 #define CLASS_NAME "VIRTUAL"
 #define COUNT 2
-#define SIZE 1024
 
 static int minornumber=0;
 static int majornumber;
@@ -34,9 +35,17 @@ static dev_t mydev;
 static struct cdev *mycdev;
 struct class *charclass;
 struct device *chardevice;
-static void *kbuffer;
 static int numdev=0;
-static ssize_t size_of_msg;
+
+/*
+ * The 1024 byte buffer became a FIFO of fifo_size bytes, shared by any
+ * number of producer and consumer processes; see chardev_fifo.h.
+ */
+static int fifo_size = 65536;
+module_param(fifo_size, int, 0444);
+MODULE_PARM_DESC(fifo_size, "FIFO size in bytes, a power of 2 (default 65536)");
+static struct chardev_fifo fifo;
+
 static ssize_t chardev_read(struct file *, char __user *, size_t, loff_t *);
 static ssize_t chardev_write(struct file *, const char __user *, size_t, loff_t *);
 static int chardev_open(struct inode *, struct file *);
@@ -55,9 +64,13 @@ static struct file_operations fops ={
 static int __init char_dev_init(void){
 	int ret;
 	pr_info("%s: Char driver Initialization\n",__func__);
+	ret=chardev_fifo_init(&fifo,fifo_size);
+	if(ret)
+		return ret;
 	ret=alloc_chrdev_region(&mydev,minornumber,COUNT,DRIVE_NAME); /*On Success return 0*/
 	if(ret){
 		pr_err("%s: allocation of chrdev region Failed\n",__func__);
+		chardev_fifo_free(&fifo);
 		return ret;
 	}
 	majornumber=MAJOR(mydev);
@@ -65,6 +78,7 @@ static int __init char_dev_init(void){
 	mycdev=cdev_alloc();
 	if(!mycdev){
 		pr_err("%s: cdev allocation failed\n",__func__);
+		ret=-ENOMEM;
 		goto unregister;
 	}
 	cdev_init(mycdev,&fops);
@@ -76,18 +90,15 @@ static int __init char_dev_init(void){
 	charclass=class_create(THIS_MODULE,CLASS_NAME);
 	if(IS_ERR(charclass)){
 		pr_err("%s: Class creation failed\n",__func__);
+		ret=PTR_ERR(charclass);
 		goto cdev_del;
 	}
 	chardevice=device_create(charclass,NULL,MKDEV(majornumber,minornumber),NULL,DRIVE_NAME);
 	if(IS_ERR(chardevice)){
 		pr_err("%s: Device creation failed\n",__func__);
+		ret=PTR_ERR(chardevice);
 		goto class_destroy;
 	}
-	kbuffer=kmalloc(SIZE,GFP_KERNEL);
-	if(!kbuffer){
-		pr_err("Kbuffer allocation failed\n");
-	}
-//	kbuffer=krealloc(kbuffer,2048,GFP_KERNEL);
 	return 0;
 class_destroy:
 	class_destroy(charclass);
@@ -95,15 +106,16 @@ cdev_del:
 	cdev_del(mycdev);
 unregister:
 	unregister_chrdev_region(mydev,COUNT);
+	chardev_fifo_free(&fifo);
 	return ret;
 }
 
 static void __exit char_dev_exit(void){
-	kfree(kbuffer);
 	device_destroy(charclass,MKDEV(majornumber,minornumber));
 	class_destroy(charclass);
 	cdev_del(mycdev);
 	unregister_chrdev_region(mydev,COUNT);
+	chardev_fifo_free(&fifo);
 	pr_info("%s: Char driver Exited successfully\n",__func__);
 }
 
@@ -117,25 +129,11 @@ static int chardev_release(struct inode *inodep, struct file *filep){
 	return 0;
 }
 static ssize_t chardev_read(struct file *filep, char __user *buffer, size_t size, loff_t *offset){
-	int err_count=0;
-	err_count=copy_to_user(buffer,kbuffer,size_of_msg);
-	if(!err_count){
-		pr_info("%s: Sent %zu characters to the user space\n",__func__,size_of_msg);
-		return size_of_msg;
-	}
-	pr_err("%s: Read operation failed\n",__func__);
-	return -EFAULT;
+	return chardev_fifo_read(&fifo,filep,buffer,size);
 }
+
 static ssize_t chardev_write(struct file *filep, const char __user *buffer, size_t size, loff_t *offset){
-	int err_count=0;
-	size_of_msg=size;
-	err_count=copy_from_user(kbuffer,buffer,size_of_msg);
-	if(err_count){
-		pr_err("%s: Write operation failed\n",__func__);
-		return -EFAULT;
-	}
-	pr_info("%s: Received %zu characters from the user space\n",__func__,size_of_msg);
-	return size_of_msg;
+	return chardev_fifo_write(&fifo,filep,buffer,size);
 }
 
 module_init(char_dev_init);
@@ -143,6 +141,6 @@ module_exit(char_dev_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("beingchandanjha@gmail.com");
-MODULE_DESCRIPTION("Char Driver");
+MODULE_DESCRIPTION("Char Driver with a FIFO");
 MODULE_VERSION(".1");
 
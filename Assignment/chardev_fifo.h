@@ -0,0 +1,183 @@
+/*
+ * Byte FIFO behind char_dev, chardrv_lock, chardev_sync and chardev_poll
+ *
+ * Writes append, reads consume what they get (possibly less than asked)
+ * and nothing is ever overwritten. kfifo needs no lock between one
+ * reader and one writer, so each side only serializes against its own
+ * kind and a reader never waits for a writer's copy to finish. A full
+ * FIFO blocks writers, an empty one readers, unless O_NONBLOCK.
+ *
+ * Wakeups are batched on watermarks: a blocking reader waits for
+ * low_mark bytes and a blocking writer that found the FIFO full for
+ * write_mark bytes of room, even when less would do, and each side only
+ * wakes the other when the level crosses that mark. The wakeups carry
+ * their poll events (EPOLLIN, EPOLLPRI past high_mark, EPOLLOUT), so a
+ * driver with a poll method only disturbs the waiters that asked for
+ * them. chardev_fifo_init() sets both marks to 1 and no high_mark; a
+ * driver may raise them before the device is registered, as long as
+ * low_mark + write_mark stays within the size: if both could be short
+ * at once neither side would wake the other.
+ *
+ * Each driver is a module of its own, so everything here is static and
+ * every module that includes it gets its own copy.
+ */
+#ifndef _CHARDEV_FIFO_H_
+#define _CHARDEV_FIFO_H_
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/kfifo.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/log2.h>
+#include <linux/poll.h>
+
+struct chardev_fifo {
+	struct kfifo fifo;
+	void *buf;			/* kvmalloc()ed: any size, not just what kmalloc gives */
+	unsigned int size;
+	struct mutex rd_lock;		/* Readers, not held while waiting */
+	struct mutex wr_lock;		/* Writers: a blocking write isn't interleaved with another */
+	wait_queue_head_t readq;	/* Waiting for data, EPOLLIN / EPOLLPRI */
+	wait_queue_head_t writeq;	/* Waiting for room, EPOLLOUT */
+	unsigned int low_mark;		/* Bytes queued that wake readers */
+	unsigned int high_mark;		/* Bytes queued that raise EPOLLPRI, 0: never */
+	unsigned int write_mark;	/* Bytes free that wake writers */
+};
+
+static int chardev_fifo_init(struct chardev_fifo *f,int size){
+	if(size<=0 || !is_power_of_2(size)){
+		pr_err("%s: fifo_size must be a power of 2\n",__func__);
+		return -EINVAL;
+	}
+	f->buf=kvmalloc(size,GFP_KERNEL);
+	if(!f->buf){
+		pr_err("%s: FIFO allocation failed\n",__func__);
+		return -ENOMEM;
+	}
+	kfifo_init(&f->fifo,f->buf,size);
+	f->size=size;
+	mutex_init(&f->rd_lock);
+	mutex_init(&f->wr_lock);
+	init_waitqueue_head(&f->readq);
+	init_waitqueue_head(&f->writeq);
+	f->low_mark=1;
+	f->high_mark=0;
+	f->write_mark=1;
+	return 0;
+}
+
+static void chardev_fifo_free(struct chardev_fifo *f){
+	kvfree(f->buf);
+	f->buf=NULL;
+}
+
+/*
+ * Takes the side's lock without sleeping on it when O_NONBLOCK: someone
+ * else busy on this side gets -EAGAIN like an empty or full FIFO does.
+ */
+static int chardev_fifo_lock(struct mutex *lock,struct file *filep){
+	if(filep->f_flags & O_NONBLOCK)
+		return mutex_trylock(lock) ? 0 : -EAGAIN;
+	return mutex_lock_interruptible(lock) ? -ERESTARTSYS : 0;
+}
+
+/*
+ * n bytes took the level from before to after: true when it reached mark
+ * from below. The other side may have taken some meanwhile (after is
+ * short of before+n) and gone to sleep below the mark: that counts too.
+ */
+static bool chardev_fifo_crossed(unsigned int before,unsigned int after,unsigned int n,unsigned int mark){
+	return after>=mark && (before<mark || after<before+n);
+}
+
+/*
+ * Returns what is in the FIFO, up to size. Blocking it first waits for
+ * low_mark bytes; non-blocking it takes whatever is there and fails with
+ * -EAGAIN only on an empty FIFO. The lock is dropped for the wait, so
+ * other readers aren't stuck behind a sleeping one, and the level is
+ * checked again once it is retaken.
+ */
+static ssize_t chardev_fifo_read(struct chardev_fifo *f,struct file *filep,char __user *buffer,size_t size){
+	unsigned int copied,avail;
+	int ret;
+
+	ret=chardev_fifo_lock(&f->rd_lock,filep);
+	if(ret)
+		return ret;
+	while(kfifo_len(&f->fifo)<f->low_mark){
+		if((filep->f_flags & O_NONBLOCK) && !kfifo_is_empty(&f->fifo))
+			break;
+		mutex_unlock(&f->rd_lock);
+		if(filep->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if(wait_event_interruptible(f->readq,kfifo_len(&f->fifo)>=f->low_mark))
+			return -ERESTARTSYS;
+		if(mutex_lock_interruptible(&f->rd_lock))
+			return -ERESTARTSYS;
+	}
+	/* A fault still consumes the bytes copied before it: return those */
+	avail=kfifo_avail(&f->fifo);
+	ret=kfifo_to_user(&f->fifo,buffer,min_t(size_t,size,f->size),&copied);
+	if(copied){
+		if(chardev_fifo_crossed(avail,kfifo_avail(&f->fifo),copied,f->write_mark))
+			wake_up_interruptible_poll(&f->writeq,EPOLLOUT|EPOLLWRNORM);
+		pr_debug("%s: Sent %u characters to the user space\n",__func__,copied);
+		ret=copied;
+	}
+	mutex_unlock(&f->rd_lock);
+	return ret;
+}
+
+/*
+ * Queues all of buffer, waiting for write_mark bytes of room whenever
+ * the FIFO is full. A blocking writer keeps the lock while it waits so
+ * its data stays in one piece; a non-blocking one never waits for it
+ * (see chardev_fifo_lock()), takes what fits and fails with -EAGAIN only
+ * if nothing does. A signal or fault after some progress returns the
+ * part written.
+ */
+static ssize_t chardev_fifo_write(struct chardev_fifo *f,struct file *filep,const char __user *buffer,size_t size){
+	unsigned int copied,before,after;
+	__poll_t events;
+	size_t done=0;
+	int ret;
+
+	ret=chardev_fifo_lock(&f->wr_lock,filep);
+	if(ret)
+		return ret;
+	while(done<size){
+		if(kfifo_is_full(&f->fifo)){
+			if(filep->f_flags & O_NONBLOCK){
+				ret=-EAGAIN;
+				break;
+			}
+			if(wait_event_interruptible(f->writeq,kfifo_avail(&f->fifo)>=f->write_mark)){
+				ret=-ERESTARTSYS;
+				break;
+			}
+		}
+		/* A fault still queues the bytes copied before it */
+		before=kfifo_len(&f->fifo);
+		ret=kfifo_from_user(&f->fifo,buffer+done,min_t(size_t,size-done,f->size),&copied);
+		done+=copied;
+		after=kfifo_len(&f->fifo);
+		events=0;
+		if(chardev_fifo_crossed(before,after,copied,f->low_mark))
+			events|=EPOLLIN|EPOLLRDNORM;
+		if(f->high_mark && chardev_fifo_crossed(before,after,copied,f->high_mark))
+			events|=EPOLLPRI;
+		if(events)
+			wake_up_interruptible_poll(&f->readq,events);
+		if(ret)
+			break;
+	}
+	mutex_unlock(&f->wr_lock);
+	if(!done)
+		return ret;
+	pr_debug("%s: Received %zu characters from the user space\n",__func__,done);
+	return done;
+}
+
+#endif
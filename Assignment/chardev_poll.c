@@ -24,10 +24,11 @@
 #include <asm/uaccess.h>
 #include <linux/poll.h>
 
+#include "chardev_fifo.h"
+
 #define DRIVE_NAME "char_dev"
 #define CLASS_NAME "VIRTUAL"
 #define COUNT 2
-#define SIZE 1024
 
 static int minornumber=0;
 static int majornumber;
@@ -35,19 +36,37 @@ static dev_t mydev;
 static struct cdev *mycdev;
 struct class *charclass;
 struct device *chardevice;
-static void *kbuffer;
 static int numdev=0;
-static ssize_t size_of_msg;
 static ssize_t chardev_read(struct file *, char __user *, size_t, loff_t *);
 static ssize_t chardev_write(struct file *, const char __user *, size_t, loff_t *);
 static int chardev_open(struct inode *, struct file *);
 static int chardev_release(struct inode *, struct file *);
-static unsigned int chardev_poll(struct file *file, struct poll_table_struct *p);
-
-static struct chardev_data {
-	 wait_queue_head_t poll_data;
-	 int data;
-}data;
+static __poll_t chardev_poll(struct file *file, struct poll_table_struct *p);
+
+/*
+ * The FIFO of chardev_fifo.h with its watermarks raised and readiness
+ * reported by poll:
+ *	EPOLLIN		at least low_watermark bytes queued
+ *	EPOLLPRI	at least high_watermark bytes queued: the consumer
+ *			is falling behind
+ *	EPOLLOUT	at least write_watermark bytes free
+ * Blocking read() and write() wait for the same levels. An edge
+ * triggered consumer reads until -EAGAIN (the FIFO is empty), the next
+ * crossing is its next edge.
+ */
+static int fifo_size = 65536;
+module_param(fifo_size, int, 0444);
+MODULE_PARM_DESC(fifo_size, "FIFO size in bytes, a power of 2 (default 65536)");
+static int low_watermark = 1;
+module_param(low_watermark, int, 0444);
+MODULE_PARM_DESC(low_watermark, "Bytes queued before readers are woken / EPOLLIN (default 1)");
+static int high_watermark;
+module_param(high_watermark, int, 0444);
+MODULE_PARM_DESC(high_watermark, "Bytes queued that raise EPOLLPRI (default 0: 3/4 of fifo_size)");
+static int write_watermark;
+module_param(write_watermark, int, 0444);
+MODULE_PARM_DESC(write_watermark, "Free bytes before writers are woken / EPOLLOUT (default 0: 1/4 of fifo_size)");
+static struct chardev_fifo fifo;
 
 static struct file_operations fops = {
 	.owner   = THIS_MODULE,
@@ -61,12 +80,27 @@ static struct file_operations fops = {
 
 static int __init char_dev_init(void){
 	int ret;
-	struct chardev_data d;
-	d = data;
 	pr_info("%s: Char driver Initialization\n",__func__);
+	ret=chardev_fifo_init(&fifo,fifo_size);
+	if(ret)
+		return ret;
+	if(!high_watermark)
+		high_watermark=max(fifo_size/4*3,1);
+	if(!write_watermark)
+		write_watermark=max(fifo_size/4,1);
+	if(low_watermark<1 || write_watermark<1 || low_watermark+write_watermark>fifo_size ||
+			high_watermark<1 || high_watermark>fifo_size){
+		pr_err("%s: watermarks must be at least 1, low_watermark + write_watermark and high_watermark at most fifo_size\n",__func__);
+		chardev_fifo_free(&fifo);
+		return -EINVAL;
+	}
+	fifo.low_mark=low_watermark;
+	fifo.high_mark=high_watermark;
+	fifo.write_mark=write_watermark;
 	ret=alloc_chrdev_region(&mydev,minornumber,COUNT,DRIVE_NAME); /*On Success return 0*/
 	if(ret){
 		pr_err("%s: allocation of chrdev region Failed\n",__func__);
+		chardev_fifo_free(&fifo);
 		return ret;
 	}
 	majornumber=MAJOR(mydev);
@@ -74,6 +108,7 @@ static int __init char_dev_init(void){
 	mycdev=cdev_alloc();
 	if(!mycdev){
 		pr_err("%s: cdev allocation failed\n",__func__);
+		ret=-ENOMEM;
 		goto unregister;
 	}
 	cdev_init(mycdev,&fops);
@@ -85,19 +120,15 @@ static int __init char_dev_init(void){
 	charclass=class_create(THIS_MODULE,CLASS_NAME);
 	if(IS_ERR(charclass)){
 		pr_err("%s: Class creation failed\n",__func__);
+		ret=PTR_ERR(charclass);
 		goto cdev_del;
 	}
 	chardevice=device_create(charclass,NULL,MKDEV(majornumber,minornumber),NULL,DRIVE_NAME);
 	if(IS_ERR(chardevice)){
 		pr_err("%s: Device creation failed\n",__func__);
+		ret=PTR_ERR(chardevice);
 		goto class_destroy;
 	}
-	kbuffer=kmalloc(SIZE,GFP_KERNEL);
-	if(!kbuffer){
-		pr_err("Kbuffer allocation failed\n");
-	}
-//	kbuffer=krealloc(kbuffer,2048,GFP_KERNEL);
-	init_waitqueue_head(&d.poll_data);
 	return 0;
 class_destroy:
 	class_destroy(charclass);
@@ -105,15 +136,16 @@ cdev_del:
 	cdev_del(mycdev);
 unregister:
 	unregister_chrdev_region(mydev,COUNT);
+	chardev_fifo_free(&fifo);
 	return ret;
 }
 
 static void __exit char_dev_exit(void){
-	kfree(kbuffer);
 	device_destroy(charclass,MKDEV(majornumber,minornumber));
 	class_destroy(charclass);
 	cdev_del(mycdev);
 	unregister_chrdev_region(mydev,COUNT);
+	chardev_fifo_free(&fifo);
 	pr_info("%s: Char driver Exited successfully\n",__func__);
 }
 
@@ -127,45 +159,33 @@ static int chardev_release(struct inode *inodep, struct file *filep){
 	return 0;
 }
 static ssize_t chardev_read(struct file *filep, char __user *buffer, size_t size, loff_t *offset){
-	int err_count=0;
-	err_count=copy_to_user(buffer,kbuffer,size_of_msg);
-	if(!err_count){
-		pr_info("%s: Sent %zu characters to the user space\n",__func__,size_of_msg);
-		return size_of_msg;
-	}
-	pr_err("%s: Read operation failed\n",__func__);
-	return -EFAULT;
+	return chardev_fifo_read(&fifo,filep,buffer,size);
 }
+
 static ssize_t chardev_write(struct file *filep, const char __user *buffer, size_t size, loff_t *offset){
-	int err_count=0;
-	size_of_msg=size;
-	err_count=copy_from_user(kbuffer,buffer,size_of_msg);
-	if(err_count){
-		pr_err("%s: Write operation failed\n",__func__);
-		return -EFAULT;
-	}
-	pr_info("%s: Received %zu characters from the user space\n",__func__,size_of_msg);
-	return size_of_msg;
+	return chardev_fifo_write(&fifo,filep,buffer,size);
 }
 
-static unsigned int chardev_poll(struct file *file, struct poll_table_struct *p)
+/*
+ * Both queues are waited on, the events come from the fill level. This
+ * runs for every poll()/epoll_wait() check, so it takes no lock: a
+ * level racing with a reader or writer is followed by its wakeup.
+ */
+static __poll_t chardev_poll(struct file *filep, struct poll_table_struct *wait)
 {
-	unsigned long revents = poll_requested_events(p);
-        u32 mask = 0;
-	struct chardev_data d;
-	d = data;
-	d.data = 1;
-        pr_info("%s: Poll event invoked\n",__func__);
-
-        if (revents & POLLPRI) {
-
-                poll_wait(file,&d.poll_data, p);
-
-                if ( d.data == 1) 
-                	mask |= POLLPRI;
-
-        } 
-        return mask;
+	unsigned int len;
+	__poll_t mask=0;
+
+	poll_wait(filep,&fifo.readq,wait);
+	poll_wait(filep,&fifo.writeq,wait);
+	len=kfifo_len(&fifo.fifo);
+	if(len>=fifo.low_mark)
+		mask|=EPOLLIN|EPOLLRDNORM;
+	if(len>=fifo.high_mark)
+		mask|=EPOLLPRI;
+	if(fifo.size-len>=fifo.write_mark)
+		mask|=EPOLLOUT|EPOLLWRNORM;
+	return mask;
 }
 module_init(char_dev_init);
 module_exit(char_dev_exit);
@@ -174,4 +194,3 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("beingchandanjha@gmail.com");
 MODULE_DESCRIPTION("Char Driver with Poll ");
 MODULE_VERSION(".1");
-
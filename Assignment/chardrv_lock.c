@@ -21,15 +21,13 @@
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include <linux/cdev.h>
-#include <linux/rwlock.h>
-#include <linux/rwlock_types.h>
 #include <asm/uaccess.h>
 
+#include "chardev_fifo.h"
+
 #define DRIVE_NAME "char_dev"
 #define CLASS_NAME "VIRTUAL"
 #define COUNT 1
-#define SIZE 1024
-rwlock_t mylock;
 
 static int minornumber=0;
 static int majornumber;
@@ -37,14 +35,23 @@ static dev_t mydev;
 static struct cdev *mycdev;
 struct class *charclass;
 struct device *chardevice;
-static void *kbuffer;
 static int numdev=0;
-static ssize_t size_of_msg;
+
+/*
+ * Byte FIFO instead of one message buffer. The read/write lock is gone:
+ * a read consumes data, so readers exclude each other as much as
+ * writers do, and the copies may sleep. One mutex per side is enough,
+ * kfifo itself is safe between a single reader and a single writer.
+ */
+static int fifo_size = 65536;
+module_param(fifo_size, int, 0444);
+MODULE_PARM_DESC(fifo_size, "FIFO size in bytes, a power of 2 (default 65536)");
+static struct chardev_fifo fifo;
+
 static ssize_t chardev_read(struct file *, char __user *, size_t, loff_t *);
 static ssize_t chardev_write(struct file *, const char __user *, size_t, loff_t *);
 static int chardev_open(struct inode *, struct file *);
 static int chardev_release(struct inode *, struct file *);
-static int readoffset;
 
 static struct file_operations fops ={
 	.owner   = THIS_MODULE,
@@ -58,9 +65,13 @@ static struct file_operations fops ={
 static int __init char_dev_init(void){
 	int ret;
 	pr_info("%s: Char driver Initialization\n",__func__);
+	ret=chardev_fifo_init(&fifo,fifo_size);
+	if(ret)
+		return ret;
 	ret=alloc_chrdev_region(&mydev,minornumber,COUNT,DRIVE_NAME); /*On Success return 0*/
 	if(ret){
 		pr_err("%s: allocation of chrdev region Failed\n",__func__);
+		chardev_fifo_free(&fifo);
 		return ret;
 	}
 	majornumber=MAJOR(mydev);
@@ -68,6 +79,7 @@ static int __init char_dev_init(void){
 	mycdev=cdev_alloc();
 	if(!mycdev){
 		pr_err("%s: cdev allocation failed\n",__func__);
+		ret=-ENOMEM;
 		goto unregister;
 	}
 	cdev_init(mycdev,&fops);
@@ -79,19 +91,15 @@ static int __init char_dev_init(void){
 	charclass=class_create(THIS_MODULE,CLASS_NAME);
 	if(IS_ERR(charclass)){
 		pr_err("%s: Class creation failed\n",__func__);
+		ret=PTR_ERR(charclass);
 		goto cdev_del;
 	}
 	chardevice=device_create(charclass,NULL,MKDEV(majornumber,minornumber),NULL,DRIVE_NAME);
 	if(IS_ERR(chardevice)){
 		pr_err("%s: Device creation failed\n",__func__);
+		ret=PTR_ERR(chardevice);
 		goto class_destroy;
 	}
-	kbuffer=kmalloc(SIZE,GFP_KERNEL);
-	if(!kbuffer){
-		pr_err("Kbuffer allocation failed\n");
-	}
-//	kbuffer=krealloc(kbuffer,2048,GFP_KERNEL);
-	rwlock_init(&mylock);
 	return 0;
 class_destroy:
 	class_destroy(charclass);
@@ -99,15 +107,16 @@ cdev_del:
 	cdev_del(mycdev);
 unregister:
 	unregister_chrdev_region(mydev,COUNT);
+	chardev_fifo_free(&fifo);
 	return ret;
 }
 
 static void __exit char_dev_exit(void){
-	kfree(kbuffer);
 	device_destroy(charclass,MKDEV(majornumber,minornumber));
 	class_destroy(charclass);
 	cdev_del(mycdev);
 	unregister_chrdev_region(mydev,COUNT);
+	chardev_fifo_free(&fifo);
 	pr_info("%s: Char driver Exited successfully\n",__func__);
 }
 
@@ -123,37 +132,11 @@ static int chardev_release(struct inode *inodep, struct file *filep){
 	return 0;
 }
 static ssize_t chardev_read(struct file *filep, char __user *buffer, size_t size, loff_t *offset){
-	int err_count=0;
-	int ret;
-	read_lock(&mylock);
-	err_count=copy_to_user(buffer,kbuffer,size_of_msg);
-	if(!err_count){
-		pr_info("%s: Sent %zu characters to the user space\n",__func__,size_of_msg);
-		readoffset+=size_of_msg;
-		ret=size_of_msg;
-	}
-	else{
-		pr_err("%s: Read operation failed\n",__func__);
-		ret= -EFAULT;
-	}
-	read_unlock(&mylock);
-	return ret;
+	return chardev_fifo_read(&fifo,filep,buffer,size);
 }
+
 static ssize_t chardev_write(struct file *filep, const char __user *buffer, size_t size, loff_t *offset){
-	int err_count=0,ret;
-	size_of_msg=size;
-	write_lock(&mylock);
-	err_count=copy_from_user(kbuffer,buffer,size_of_msg);
-	if(err_count){
-		pr_err("%s: Write operation failed\n",__func__);
-		ret=-EFAULT;
-	}
-	else{
-		pr_info("%s: Received %zu characters from the user space\n",__func__,size_of_msg);
-		ret=size_of_msg;
-	}
-	write_unlock(&mylock);
-	return ret;
+	return chardev_fifo_write(&fifo,filep,buffer,size);
 }
 
 module_init(char_dev_init);
@@ -161,6 +144,6 @@ module_exit(char_dev_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("beingchandanjha@gmail.com");
-MODULE_DESCRIPTION("Char Driver with Read write lock");
+MODULE_DESCRIPTION("Char Driver with reader and writer locks over a FIFO");
 MODULE_VERSION(".1");
 
@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+#
+# Summarize the fio JSON output of vd_bench.sh into summary.json and
+# summary.csv in the result directory. With --baseline, compare against
+# the summary.json of an earlier run and exit with 2 if any job lost
+# more than --threshold percent of IOPS or gained as much p99 latency.
+#
+# Usage: fio_summary.py <result dir> [--baseline old/summary.json] [--threshold 5]
+
+import argparse
+import csv
+import glob
+import json
+import os
+import sys
+
+PERCENTILES = ["50", "90", "99", "99.9", "99.99"]
+FIELDS = ["job", "dir", "iops", "bw_mib", "clat_mean_us"] + \
+	["clat_p%s_us" % p for p in PERCENTILES] + ["cpu_us_per_io"]
+
+
+def percentile(clat, p):
+	pct = clat.get("percentile", {})
+	ns = pct.get("%.6f" % float(p))
+	return round(ns / 1000.0, 2) if ns is not None else None
+
+
+def summarize(path):
+	with open(path) as f:
+		# fio may print warnings before the JSON document
+		text = f.read()
+		job = json.loads(text[text.index("{"):])["jobs"][0]
+	runtime_s = job["job_runtime"] / 1000.0
+	total_ios = sum(job[d]["total_ios"] for d in ("read", "write"))
+	cpu = (job["usr_cpu"] + job["sys_cpu"]) / 100.0 * runtime_s
+	rows = []
+	for d in ("read", "write"):
+		st = job[d]
+		if not st["total_ios"]:
+			continue
+		row = {
+			"job": job["jobname"],
+			"dir": d,
+			"iops": round(st["iops"], 1),
+			"bw_mib": round(st["bw_bytes"] / 2**20, 1),
+			"clat_mean_us": round(st["clat_ns"]["mean"] / 1000.0, 2),
+			# CPU time of all the job's threads, split over both directions
+			"cpu_us_per_io": round(cpu * 1e6 / total_ios, 3) if total_ios else None,
+		}
+		for p in PERCENTILES:
+			row["clat_p%s_us" % p] = percentile(st["clat_ns"], p)
+		rows.append(row)
+	return rows
+
+
+def compare(rows, baseline, threshold):
+	old = {(r["job"], r["dir"]): r for r in baseline}
+	worse = 0
+	for r in rows:
+		b = old.get((r["job"], r["dir"]))
+		if not b:
+			continue
+		d_iops = (r["iops"] - b["iops"]) * 100.0 / b["iops"] if b["iops"] else 0.0
+		d_p99 = 0.0
+		if b.get("clat_p99_us") and r.get("clat_p99_us") is not None:
+			d_p99 = (r["clat_p99_us"] - b["clat_p99_us"]) * 100.0 / b["clat_p99_us"]
+		bad = d_iops < -threshold or d_p99 > threshold
+		worse += bad
+		print("%-24s %-5s iops %+7.1f%%  p99 %+7.1f%%%s" % (r["job"], r["dir"], d_iops, d_p99,
+			"  REGRESSION" if bad else ""))
+	return worse
+
+
+def main():
+	ap = argparse.ArgumentParser()
+	ap.add_argument("dir")
+	ap.add_argument("--baseline")
+	ap.add_argument("--threshold", type=float, default=5.0)
+	args = ap.parse_args()
+
+	rows = []
+	for path in sorted(glob.glob(os.path.join(args.dir, "jobs", "*.json"))):
+		rows += summarize(path)
+	if not rows:
+		sys.exit("%s: no fio results in %s/jobs" % (sys.argv[0], args.dir))
+
+	env = {}
+	env_path = os.path.join(args.dir, "env.txt")
+	if os.path.exists(env_path):
+		with open(env_path) as f:
+			env = dict(l.rstrip("\n").split("=", 1) for l in f if "=" in l)
+	with open(os.path.join(args.dir, "summary.json"), "w") as f:
+		json.dump({"env": env, "results": rows}, f, indent=1)
+	with open(os.path.join(args.dir, "summary.csv"), "w", newline="") as f:
+		w = csv.DictWriter(f, fieldnames=FIELDS)
+		w.writeheader()
+		w.writerows(rows)
+
+	for r in rows:
+		print("%-24s %-5s %10.1f IOPS %9.1f MiB/s  p50 %8s us  p99 %8s us  %s us CPU/IO" % (r["job"],
+			r["dir"], r["iops"], r["bw_mib"], r["clat_p50_us"], r["clat_p99_us"], r["cpu_us_per_io"]))
+
+	if args.baseline:
+		with open(args.baseline) as f:
+			baseline = json.load(f)["results"]
+		print("\nagainst %s:" % args.baseline)
+		if compare(rows, baseline, args.threshold):
+			sys.exit(2)
+
+
+if __name__ == "__main__":
+	main()
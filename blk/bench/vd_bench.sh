@@ -0,0 +1,139 @@
+#!/bin/bash
+#
+# Run a fixed matrix of fio jobs against a vd disk and summarize them.
+#
+# Every run uses the same jobs, sizes, seeds and run times, so the
+# summary.json / summary.csv of two driver versions can be compared
+# line by line (fio_summary.py --baseline does it).
+#
+# Usage: vd_bench.sh [-m vd.ko] [-p "module params"] [-d /dev/vda] [-s size]
+#                    [-t seconds] [-e ioengine] [-o outdir] [-b baseline.json]
+#
+#   -m	module to load first and unload at the end (default: use the
+#	disk as it is)
+#   -p	parameters for the module (default: rd_nr=1 nsector=<size>)
+#   -d	disk to test (default /dev/vda)
+#   -s	bytes of the disk to use, K/M/G suffix (default 1G)
+#   -t	run time of each job after a 2 second ramp (default 20)
+#   -e	fio ioengine (default io_uring, libaio if fio lacks it)
+#   -o	result directory (default bench-<date>)
+#   -b	summary.json of an earlier run to compare against
+#
+# Needs root, fio and python3.
+
+set -e
+
+here=$(dirname "$(readlink -f "$0")")
+module=
+params=
+dev=/dev/vda
+size=1G
+runtime=20
+engine=
+out=bench-$(date +%Y%m%d-%H%M%S)
+baseline=
+
+while getopts "m:p:d:s:t:e:o:b:h" opt; do
+	case $opt in
+	m) module=$OPTARG ;;
+	p) params=$OPTARG ;;
+	d) dev=$OPTARG ;;
+	s) size=$OPTARG ;;
+	t) runtime=$OPTARG ;;
+	e) engine=$OPTARG ;;
+	o) out=$OPTARG ;;
+	b) baseline=$OPTARG ;;
+	*) sed -n '3,22p' "$0" | sed 's/^# \{0,1\}//'; exit 1 ;;
+	esac
+done
+
+for tool in fio python3; do
+	command -v $tool >/dev/null || { echo "$0: $tool not found" >&2; exit 1; }
+done
+if [ "$(id -u)" != 0 ]; then
+	echo "$0: must run as root" >&2
+	exit 1
+fi
+if [ -z "$engine" ]; then
+	engine=libaio
+	fio --enghelp 2>/dev/null | grep -qw io_uring && engine=io_uring
+fi
+
+bytes=$(numfmt --from=iec "$size")
+
+# name rw bs iodepth numjobs rwmixread
+matrix="
+randread-4k-qd1		randread	4k	1	1	-
+randread-4k-qd32	randread	4k	32	1	-
+randread-4k-qd32-j4	randread	4k	32	4	-
+randwrite-4k-qd1	randwrite	4k	1	1	-
+randwrite-4k-qd32	randwrite	4k	32	1	-
+randwrite-4k-qd32-j4	randwrite	4k	32	4	-
+read-1m-qd8		read		1m	8	1	-
+write-1m-qd8		write		1m	8	1	-
+randrw70-4k-qd32	randrw		4k	32	1	70
+randrw70-4k-qd32-j4	randrw		4k	32	4	70
+"
+
+loaded=
+cleanup() {
+	if [ -n "$loaded" ]; then
+		rmmod "$(basename "$module" .ko)" || echo "$0: could not unload $module" >&2
+	fi
+}
+trap cleanup EXIT
+
+if [ -n "$module" ]; then
+	[ -n "$params" ] || params="rd_nr=1 nsector=$((bytes / 512))"
+	# shellcheck disable=SC2086
+	insmod "$module" $params
+	loaded=1
+	udevadm settle 2>/dev/null || sleep 1
+fi
+if [ ! -b "$dev" ]; then
+	echo "$0: $dev is not a block device" >&2
+	exit 1
+fi
+disk=$(basename "$dev")
+
+mkdir -p "$out/jobs"
+{
+	echo "date=$(date -Is)"
+	echo "kernel=$(uname -r)"
+	echo "fio=$(fio --version)"
+	echo "cpus=$(nproc)"
+	echo "dev=$dev"
+	echo "size=$bytes"
+	echo "runtime=$runtime"
+	echo "engine=$engine"
+	echo "module=${module:-none}"
+	echo "params=$params"
+	if [ -r /sys/module/vd/srcversion ]; then
+		echo "srcversion=$(cat /sys/module/vd/srcversion)"
+	fi
+	echo "scheduler=$(cat "/sys/block/$disk/queue/scheduler")"
+} > "$out/env.txt"
+
+common=(--filename="$dev" --size="$bytes" --direct=1 --ioengine="$engine"
+	--randrepeat=1 --randseed=4242 --norandommap --group_reporting
+	--percentile_list=50:90:99:99.9:99.99 --output-format=json)
+
+# Reads of a hole never touch memory: fill the disk once so every job sees backed pages
+echo "preconditioning $dev"
+fio "${common[@]}" --name=fill --rw=write --bs=1m --iodepth=8 > "$out/fill.json"
+
+echo "$matrix" | while read -r name rw bs qd jobs mix; do
+	[ -n "$name" ] || continue
+	echo "running $name"
+	extra=()
+	[ "$mix" != - ] && extra=(--rwmixread="$mix")
+	# Parallel jobs each take their own slice of the disk
+	[ "$jobs" -gt 1 ] && extra+=(--offset_increment=$((bytes / jobs)) --size=$((bytes / jobs)))
+	fio "${common[@]}" --name="$name" --rw="$rw" --bs="$bs" --iodepth="$qd" \
+		--numjobs="$jobs" --time_based --ramp_time=2 --runtime="$runtime" \
+		"${extra[@]}" > "$out/jobs/$name.json"
+done
+
+args=("$out")
+[ -n "$baseline" ] && args+=(--baseline "$baseline")
+python3 "$here/fio_summary.py" "${args[@]}"
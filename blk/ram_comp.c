@@ -0,0 +1,439 @@
+/*
+ * Compressed backing for the RAM store, see ram_comp.h
+ */
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/crypto.h>
+#include <linux/ktime.h>
+#include <linux/zsmalloc.h>
+
+#include "ram_comp.h"
+
+#if IS_ENABLED(CONFIG_ZSMALLOC)
+
+#define RC_LOCKS	64			/* power of 2 */
+#define RC_HUGE_SIZE	(PAGE_SIZE / 4 * 3)	/* Less than 25% saved: not worth a decompress */
+
+struct rc_entry {
+	unsigned long handle;		/* zsmalloc object, 0 for a same filled page */
+	unsigned long fill;		/* the repeated word of a same filled page */
+	unsigned int len;		/* compressed size, PAGE_SIZE when stored raw */
+};
+
+struct rc_strm {
+	struct crypto_comp *tfm;
+	void *page;			/* whole page being merged / decompressed */
+	void *cbuf;			/* compressor output, 2 pages like zram */
+};
+
+struct ram_comp {
+	struct zs_pool *pool;
+	struct rc_strm __percpu *strm;
+	char alg[CRYPTO_MAX_ALG_NAME];
+	struct mutex locks[RC_LOCKS];
+	atomic64_t compr_bytes;
+	atomic64_t same_pages;
+	atomic64_t huge_pages;
+	atomic64_t comp_ops, comp_ns;
+	atomic64_t decomp_ops, decomp_ns;
+};
+
+static struct mutex *rc_lock(struct ram_comp *c, pgoff_t idx)
+{
+	return &c->locks[idx & (RC_LOCKS - 1)];
+}
+
+static bool rc_same_filled(const void *ptr, unsigned long *fill)
+{
+	const unsigned long *p = ptr;
+	unsigned int i;
+
+	for (i = 1; i < PAGE_SIZE / sizeof(*p); i++)
+		if (p[i] != p[0])
+			return false;
+	*fill = p[0];
+	return true;
+}
+
+/* Add (+1) or remove (-1) e from the pool statistics */
+static void rc_account(struct ram_comp *c, struct rc_entry *e, int sign)
+{
+	if (!e->handle) {
+		atomic64_add(sign, &c->same_pages);
+		return;
+	}
+	atomic64_add(sign * (long)e->len, &c->compr_bytes);
+	if (e->len == PAGE_SIZE)
+		atomic64_add(sign, &c->huge_pages);
+}
+
+static void rc_free_entry(struct ram_comp *c, struct rc_entry *e)
+{
+	rc_account(c, e, -1);
+	if (e->handle)
+		zs_free(c->pool, e->handle);
+	kfree(e);
+}
+
+/* Uncompress e into buf (a whole page); a hole reads as zeroes */
+static void rc_load(struct ram_comp *c, struct rc_strm *s, struct rc_entry *e, void *buf)
+{
+	unsigned int dlen = PAGE_SIZE;
+	const void *src;
+	u64 t;
+
+	if (!e) {
+		memset(buf, 0, PAGE_SIZE);
+		return;
+	}
+	if (!e->handle) {
+		memset_l(buf, e->fill, PAGE_SIZE / sizeof(unsigned long));
+		return;
+	}
+	src = zs_map_object(c->pool, e->handle, ZS_MM_RO);
+	if (e->len == PAGE_SIZE) {
+		memcpy(buf, src, PAGE_SIZE);
+	} else {
+		t = ktime_get_ns();
+		WARN_ON_ONCE(crypto_comp_decompress(s->tfm, src, e->len, buf, &dlen) || dlen != PAGE_SIZE);
+		atomic64_add(ktime_get_ns() - t, &c->decomp_ns);
+		atomic64_inc(&c->decomp_ops);
+	}
+	zs_unmap_object(c->pool, e->handle);
+}
+
+/*
+ * Merge len bytes of src at offset into page idx and store the result.
+ * The first zsmalloc attempt can't sleep since it runs on the per CPU
+ * stream. When it fails and gfp allows, the object is allocated sleeping
+ * and the page compressed again: under the page lock nothing changed,
+ * so the size comes out the same.
+ */
+static int rc_write_page(struct ram_store *rs, pgoff_t idx, unsigned int offset, const void *src,
+		size_t len, gfp_t gfp)
+{
+	struct ram_comp *c = rs->comp;
+	struct mutex *lock = rc_lock(c, idx);
+	struct rc_entry *e, *old, *cur;
+	struct rc_strm *s;
+	unsigned long handle = 0, fill;
+	unsigned int clen, alloc_len = 0;
+	const void *page, *data;
+	void *dst;
+	u64 t;
+	int ret = 0;
+
+	e = kmalloc(sizeof(*e), gfp | __GFP_NOWARN);
+	if (!e)
+		return -ENOMEM;
+	mutex_lock(lock);
+	old = xa_load(&rs->pages, idx);
+again:
+	s = get_cpu_ptr(c->strm);
+	if (offset == 0 && len == PAGE_SIZE) {
+		page = src;
+	} else {
+		rc_load(c, s, old, s->page);
+		memcpy(s->page + offset, src, len);
+		page = s->page;
+	}
+	if (rc_same_filled(page, &fill)) {
+		put_cpu_ptr(c->strm);
+		if (handle)
+			zs_free(c->pool, handle);
+		if (!fill) {                                    /* All zeroes: make it a hole */
+			kfree(e);
+			if (old) {
+				xa_erase(&rs->pages, idx);
+				rc_free_entry(c, old);
+				atomic_long_dec(&rs->nr_pages);
+			}
+			goto out_unlock;
+		}
+		e->handle = 0;
+		e->fill = fill;
+		e->len = 0;
+		goto install;
+	}
+
+	clen = 2 * PAGE_SIZE;
+	t = ktime_get_ns();
+	ret = crypto_comp_compress(s->tfm, page, PAGE_SIZE, s->cbuf, &clen);
+	atomic64_add(ktime_get_ns() - t, &c->comp_ns);
+	atomic64_inc(&c->comp_ops);
+	data = s->cbuf;
+	if (ret || clen >= RC_HUGE_SIZE) {
+		clen = PAGE_SIZE;
+		data = page;
+	}
+	ret = 0;
+	if (handle && alloc_len != clen) {
+		zs_free(c->pool, handle);
+		handle = 0;
+	}
+	if (!handle) {
+		handle = zs_malloc(c->pool, clen, __GFP_KSWAPD_RECLAIM | __GFP_NOWARN |
+			__GFP_HIGHMEM | __GFP_MOVABLE);
+		if (!handle) {
+			put_cpu_ptr(c->strm);
+			if (gfpflags_allow_blocking(gfp))
+				handle = zs_malloc(c->pool, clen, gfp | __GFP_HIGHMEM | __GFP_MOVABLE);
+			if (!handle) {
+				ret = -ENOMEM;
+				kfree(e);
+				goto out_unlock;
+			}
+			alloc_len = clen;
+			goto again;                             /* We may be on another CPU now */
+		}
+		alloc_len = clen;
+	}
+	dst = zs_map_object(c->pool, handle, ZS_MM_WO);
+	memcpy(dst, data, clen);
+	zs_unmap_object(c->pool, handle);
+	put_cpu_ptr(c->strm);
+	e->handle = handle;
+	e->fill = 0;
+	e->len = clen;
+
+install:
+	cur = xa_store(&rs->pages, idx, e, gfp);
+	if (xa_is_err(cur)) {
+		ret = xa_err(cur);
+		if (e->handle)
+			zs_free(c->pool, e->handle);
+		kfree(e);
+		goto out_unlock;
+	}
+	rc_account(c, e, 1);
+	if (old)
+		rc_free_entry(c, old);
+	else
+		atomic_long_inc(&rs->nr_pages);
+out_unlock:
+	mutex_unlock(lock);
+	return ret;
+}
+
+static void rc_read_page(struct ram_store *rs, pgoff_t idx, unsigned int offset, void *dst, size_t len)
+{
+	struct ram_comp *c = rs->comp;
+	struct mutex *lock = rc_lock(c, idx);
+	struct rc_entry *e;
+	struct rc_strm *s;
+
+	mutex_lock(lock);
+	e = xa_load(&rs->pages, idx);
+	if (!e) {
+		memset(dst, 0, len);
+	} else if (!e->handle) {
+		memset_l(dst, e->fill, len / sizeof(unsigned long));
+	} else {
+		s = get_cpu_ptr(c->strm);
+		if (offset == 0 && len == PAGE_SIZE) {
+			rc_load(c, s, e, dst);
+		} else {
+			rc_load(c, s, e, s->page);
+			memcpy(dst, s->page + offset, len);
+		}
+		put_cpu_ptr(c->strm);
+	}
+	mutex_unlock(lock);
+}
+
+int ram_comp_write(struct ram_store *rs, sector_t sector, const void *src, size_t n, gfp_t gfp)
+{
+	int ret;
+
+	while (n) {
+		pgoff_t idx = sector >> RS_PAGE_SECTORS_SHIFT;
+		unsigned int offset = (sector & (RS_PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		size_t len = min_t(size_t, n, PAGE_SIZE - offset);
+
+		ret = rc_write_page(rs, idx, offset, src, len, gfp);
+		if (ret)
+			return ret;
+		src += len;
+		n -= len;
+		sector += len >> SECTOR_SHIFT;
+	}
+	return 0;
+}
+
+void ram_comp_read(struct ram_store *rs, sector_t sector, void *dst, size_t n)
+{
+	while (n) {
+		pgoff_t idx = sector >> RS_PAGE_SECTORS_SHIFT;
+		unsigned int offset = (sector & (RS_PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		size_t len = min_t(size_t, n, PAGE_SIZE - offset);
+
+		rc_read_page(rs, idx, offset, dst, len);
+		dst += len;
+		n -= len;
+		sector += len >> SECTOR_SHIFT;
+	}
+}
+
+/*
+ * Discard has no way to fail, so zeroing part of a compressed page (which
+ * may need a new object) can't give up: the disk is in process context
+ * here (BLK_MQ_F_BLOCKING when compressing).
+ */
+void ram_comp_zero(struct ram_store *rs, pgoff_t idx, unsigned int offset, size_t len)
+{
+	struct ram_comp *c = rs->comp;
+	struct mutex *lock = rc_lock(c, idx);
+	struct rc_entry *e;
+
+	if (offset || len != PAGE_SIZE) {
+		rc_write_page(rs, idx, offset, page_address(ZERO_PAGE(0)), len, GFP_NOIO | __GFP_NOFAIL);
+		return;
+	}
+	mutex_lock(lock);
+	e = xa_erase(&rs->pages, idx);
+	if (e) {
+		rc_free_entry(c, e);
+		atomic_long_dec(&rs->nr_pages);
+	}
+	mutex_unlock(lock);
+}
+
+void ram_comp_get_stats(struct ram_store *rs, struct ram_comp_stats *st)
+{
+	struct ram_comp *c = rs->comp;
+
+	st->orig_pages = ram_store_pages(rs);
+	st->compr_bytes = atomic64_read(&c->compr_bytes);
+	st->mem_used = (u64)zs_get_total_pages(c->pool) << PAGE_SHIFT;
+	st->same_pages = atomic64_read(&c->same_pages);
+	st->huge_pages = atomic64_read(&c->huge_pages);
+	st->comp_ops = atomic64_read(&c->comp_ops);
+	st->comp_ns = atomic64_read(&c->comp_ns);
+	st->decomp_ops = atomic64_read(&c->decomp_ops);
+	st->decomp_ns = atomic64_read(&c->decomp_ns);
+}
+
+const char *ram_comp_alg(struct ram_store *rs)
+{
+	return rs->comp->alg;
+}
+
+static void rc_free_strms(struct ram_comp *c)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct rc_strm *s = per_cpu_ptr(c->strm, cpu);
+
+		if (!IS_ERR_OR_NULL(s->tfm))
+			crypto_free_comp(s->tfm);
+		free_page((unsigned long)s->page);
+		kfree(s->cbuf);
+	}
+	free_percpu(c->strm);
+}
+
+int ram_comp_init(struct ram_store *rs, const char *alg, const char *name)
+{
+	struct ram_comp *c;
+	int cpu, i, ret = -ENOMEM;
+
+	if (!crypto_has_comp(alg, 0, 0)) {
+		pr_err("%s: compression algorithm %s is not available\n", __func__, alg);
+		return -ENOENT;
+	}
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return -ENOMEM;
+	strscpy(c->alg, alg, sizeof(c->alg));
+	for (i = 0; i < RC_LOCKS; i++)
+		mutex_init(&c->locks[i]);
+	c->strm = alloc_percpu(struct rc_strm);
+	if (!c->strm)
+		goto free_comp;
+	for_each_possible_cpu(cpu) {
+		struct rc_strm *s = per_cpu_ptr(c->strm, cpu);
+
+		s->tfm = crypto_alloc_comp(alg, 0, 0);
+		s->page = (void *)__get_free_page(GFP_KERNEL);
+		s->cbuf = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+		if (IS_ERR(s->tfm)) {
+			ret = PTR_ERR(s->tfm);
+			goto free_strms;
+		}
+		if (!s->page || !s->cbuf)
+			goto free_strms;
+	}
+	c->pool = zs_create_pool(name);
+	if (!c->pool)
+		goto free_strms;
+	rs->comp = c;
+	return 0;
+
+free_strms:
+	rc_free_strms(c);
+free_comp:
+	kfree(c);
+	return ret;
+}
+
+void ram_comp_free(struct ram_store *rs)
+{
+	struct ram_comp *c = rs->comp;
+	struct rc_entry *e;
+	unsigned long idx;
+
+	if (!c)
+		return;
+	xa_for_each(&rs->pages, idx, e) {
+		rc_free_entry(c, e);
+		cond_resched();
+	}
+	xa_destroy(&rs->pages);
+	zs_destroy_pool(c->pool);
+	rc_free_strms(c);
+	kfree(c);
+	rs->comp = NULL;
+}
+
+#else /* !CONFIG_ZSMALLOC */
+
+int ram_comp_init(struct ram_store *rs, const char *alg, const char *name)
+{
+	pr_err("%s: compression needs a kernel with CONFIG_ZSMALLOC\n", __func__);
+	return -EOPNOTSUPP;
+}
+
+void ram_comp_free(struct ram_store *rs)
+{
+}
+
+int ram_comp_write(struct ram_store *rs, sector_t sector, const void *src, size_t n, gfp_t gfp)
+{
+	return -EIO;
+}
+
+void ram_comp_read(struct ram_store *rs, sector_t sector, void *dst, size_t n)
+{
+}
+
+void ram_comp_zero(struct ram_store *rs, pgoff_t idx, unsigned int offset, size_t len)
+{
+}
+
+void ram_comp_get_stats(struct ram_store *rs, struct ram_comp_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+}
+
+const char *ram_comp_alg(struct ram_store *rs)
+{
+	return "none";
+}
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * Compressed backing for the RAM store
+ *
+ * With compression enabled the xarray of a ram_store no longer holds
+ * pages but one struct rc_entry per written page:
+ *  - a page repeating one word (zeroes, 0xff fill, ...) keeps only that
+ *    word and costs no backing memory at all; an all zero page is simply
+ *    left as (or turned back into) a hole
+ *  - any other page is compressed with a crypto API compressor (lz4,
+ *    lzo, ...) and the result stored in a zsmalloc pool, which packs
+ *    objects of every size class densely into its own pages
+ *  - a page that doesn't shrink below RC_HUGE_SIZE is stored as is
+ *
+ * A partial page write is a read-modify-write of the whole page, so
+ * every page is serialized by one of RC_LOCKS hashed mutexes. The
+ * compressor and its buffers are per CPU.
+ */
+#ifndef _RAM_COMP_H_
+#define _RAM_COMP_H_
+
+#include "ram_store.h"
+
+struct ram_comp_stats {
+	u64 orig_pages;		/* pages written, same filled included */
+	u64 compr_bytes;	/* sum of the compressed sizes */
+	u64 mem_used;		/* bytes the zsmalloc pool takes from the system */
+	u64 same_pages;		/* stored as one repeated word */
+	u64 huge_pages;		/* didn't compress, stored raw */
+	u64 comp_ops, comp_ns;	/* CPU time spent in the compressor */
+	u64 decomp_ops, decomp_ns;
+};
+
+int ram_comp_init(struct ram_store *rs, const char *alg, const char *name);
+void ram_comp_free(struct ram_store *rs);
+int ram_comp_write(struct ram_store *rs, sector_t sector, const void *src, size_t n, gfp_t gfp);
+void ram_comp_read(struct ram_store *rs, sector_t sector, void *dst, size_t n);
+/* Zero len bytes at offset of page idx; a whole page is dropped */
+void ram_comp_zero(struct ram_store *rs, pgoff_t idx, unsigned int offset, size_t len);
+void ram_comp_get_stats(struct ram_store *rs, struct ram_comp_stats *st);
+const char *ram_comp_alg(struct ram_store *rs);
+
+#endif
@@ -0,0 +1,400 @@
+/*
+ * Content addressed deduplication for the RAM store, see ram_dedup.h
+ */
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/gfp.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/refcount.h>
+#include <linux/rcupdate.h>
+#include <linux/log2.h>
+#include <linux/xxhash.h>
+
+#include "ram_dedup.h"
+
+#if IS_ENABLED(CONFIG_XXHASH)
+
+#define RD_LOCKS	256			/* power of 2 */
+#define RD_MIN_BITS	10
+#define RD_MAX_BITS	22
+
+/*
+ * page->private of a store page: RD_PRIVATE for a private page, which
+ * partial writes change in place, else its rd_entry. A page keeps the
+ * value until it is freed, so a writer that looked it up just before it
+ * left the slot never takes a hashed page for a private one.
+ */
+#define RD_PRIVATE	1UL
+
+/* One per hashed page, found through page->private */
+struct rd_entry {
+	struct hlist_node node;
+	u64 hash;
+	struct page *page;
+	refcount_t ref;				/* page indexes pointing at page */
+};
+
+struct ram_dedup {
+	struct hlist_head *table;
+	unsigned int bits;
+	spinlock_t locks[RD_LOCKS];		/* hashed over the buckets */
+	atomic_long_t logical_pages;
+	atomic_long_t shared_pages;
+	atomic64_t dup_hits;
+	atomic64_t collisions;
+	atomic64_t cow_breaks;
+};
+
+static struct hlist_head *rd_bucket(struct ram_dedup *d, u64 hash)
+{
+	return &d->table[hash & ((1UL << d->bits) - 1)];
+}
+
+static spinlock_t *rd_lock(struct ram_dedup *d, u64 hash)
+{
+	return &d->locks[hash & (RD_LOCKS - 1)];
+}
+
+static void rd_account(struct ram_store *rs, struct page *page, int sign)
+{
+	atomic_long_add(sign, &rs->nr_pages);
+	atomic_long_add(sign, &rs->node_pages[page_to_nid(page)]);
+}
+
+static void rd_free_page_rcu(struct rcu_head *head)
+{
+	struct page *page = container_of(head, struct page, rcu_head);
+
+	set_page_private(page, 0);
+	__free_page(page);
+}
+
+/*
+ * Drop a reference to page. The last one takes a hashed page out of the
+ * table under the bucket lock, so a lookup never finds an entry on its
+ * way out; the page itself goes after a grace period since readers may
+ * still be copying from it.
+ */
+static void rd_put(struct ram_store *rs, struct page *page)
+{
+	struct ram_dedup *d = rs->dedup;
+	struct rd_entry *e = (struct rd_entry *)page_private(page);
+
+	if (page_private(page) != RD_PRIVATE) {
+		if (!refcount_dec_and_lock(&e->ref, rd_lock(d, e->hash)))
+			return;
+		hlist_del(&e->node);
+		spin_unlock(rd_lock(d, e->hash));
+		atomic_long_dec(&d->shared_pages);
+		kfree(e);
+	}
+	rd_account(rs, page, -1);
+	call_rcu(&page->rcu_head, rd_free_page_rcu);
+}
+
+/* Entry with the same data as the page at src, referenced for the caller. Bucket locked. */
+static struct page *rd_lookup(struct ram_dedup *d, u64 hash, const void *src, bool count)
+{
+	struct rd_entry *e;
+	void *p;
+	int diff;
+
+	hlist_for_each_entry(e, rd_bucket(d, hash), node) {
+		if (e->hash != hash)
+			continue;
+		p = kmap_local_page(e->page);
+		diff = memcmp(p, src, PAGE_SIZE);
+		kunmap_local(p);
+		if (!diff) {
+			refcount_inc(&e->ref);
+			return e->page;
+		}
+		if (count)
+			atomic64_inc(&d->collisions);
+	}
+	return NULL;
+}
+
+/*
+ * A page holding the data at src, with a reference for the caller: an
+ * equal page already stored, else a new one entered into the table.
+ * Two writers of the same new data both allocate; the second to take the
+ * bucket lock finds the first's page and frees its own.
+ */
+static struct page *rd_get(struct ram_store *rs, const void *src, gfp_t gfp)
+{
+	struct ram_dedup *d = rs->dedup;
+	u64 hash = xxh64(src, PAGE_SIZE, 0);
+	spinlock_t *lock = rd_lock(d, hash);
+	struct page *page, *cur;
+	struct rd_entry *e;
+
+	spin_lock(lock);
+	page = rd_lookup(d, hash, src, true);
+	spin_unlock(lock);
+	if (page) {
+		atomic64_inc(&d->dup_hits);
+		return page;
+	}
+
+	e = kmalloc(sizeof(*e), gfp | __GFP_NOWARN);
+	page = alloc_page(gfp | __GFP_HIGHMEM | __GFP_NOWARN);
+	if (!e || !page) {
+		kfree(e);
+		if (page)
+			__free_page(page);
+		return NULL;
+	}
+	memcpy_to_page(page, 0, src, PAGE_SIZE);
+	e->hash = hash;
+	e->page = page;
+	refcount_set(&e->ref, 1);
+
+	spin_lock(lock);
+	cur = rd_lookup(d, hash, src, false);
+	if (!cur) {
+		set_page_private(page, (unsigned long)e);
+		hlist_add_head(&e->node, rd_bucket(d, hash));
+	}
+	spin_unlock(lock);
+	if (cur) {
+		__free_page(page);
+		kfree(e);
+		atomic64_inc(&d->dup_hits);
+		return cur;
+	}
+	atomic_long_inc(&d->shared_pages);
+	rd_account(rs, page, 1);
+	return page;
+}
+
+/* A whole page: point idx at the stored copy of its data */
+static int rd_write_full(struct ram_store *rs, pgoff_t idx, const void *src, gfp_t gfp)
+{
+	struct page *page, *old;
+
+	page = rd_get(rs, src, gfp);
+	if (!page)
+		return -ENOMEM;
+	old = xa_store(&rs->pages, idx, page, gfp);
+	if (xa_is_err(old)) {
+		rd_put(rs, page);
+		return xa_err(old);
+	}
+	if (old)
+		rd_put(rs, old);
+	else
+		atomic_long_inc(&rs->dedup->logical_pages);
+	return 0;
+}
+
+static void rd_copy(struct page *page, unsigned int offset, const void *src, size_t len)
+{
+	if (src)
+		memcpy_to_page(page, offset, src, len);
+	else
+		memzero_page(page, offset, len);
+}
+
+/*
+ * Merge len bytes of src (NULL: zeroes) at offset into page idx. A
+ * private page (RD_PRIVATE) is changed in place. A hole or a hashed
+ * page, which never changes, is copied into a new private page that
+ * replaces it unless the slot changed meanwhile: then it starts over.
+ * The extra page reference keeps the old page from being freed and
+ * reused while it is copied.
+ */
+static int rd_write_partial(struct ram_store *rs, pgoff_t idx, unsigned int offset, const void *src,
+		size_t len, gfp_t gfp)
+{
+	struct page *page, *old, *cur;
+
+again:
+	rcu_read_lock();
+	old = xa_load(&rs->pages, idx);
+	if (old && page_private(old) == RD_PRIVATE) {
+		rd_copy(old, offset, src, len);
+		rcu_read_unlock();
+		return 0;
+	}
+	if (old)
+		get_page(old);
+	rcu_read_unlock();
+	if (!old && !src)
+		return 0;                                       /* Zeroing a hole */
+
+	page = alloc_page(gfp | __GFP_HIGHMEM | __GFP_NOWARN);
+	if (!page) {
+		if (old)
+			put_page(old);
+		return -ENOMEM;
+	}
+	if (old)
+		copy_highpage(page, old);
+	else
+		clear_highpage(page);
+	rd_copy(page, offset, src, len);
+	set_page_private(page, RD_PRIVATE);
+	cur = xa_cmpxchg(&rs->pages, idx, old, page, gfp);
+	if (cur != old) {
+		set_page_private(page, 0);
+		__free_page(page);
+		if (old)
+			put_page(old);
+		if (xa_is_err(cur))
+			return xa_err(cur);
+		goto again;
+	}
+	rd_account(rs, page, 1);
+	if (old) {
+		rd_put(rs, old);
+		put_page(old);
+		atomic64_inc(&rs->dedup->cow_breaks);
+	} else {
+		atomic_long_inc(&rs->dedup->logical_pages);
+	}
+	return 0;
+}
+
+int ram_dedup_write(struct ram_store *rs, sector_t sector, const void *src, size_t n, gfp_t gfp)
+{
+	int ret;
+
+	while (n) {
+		pgoff_t idx = sector >> RS_PAGE_SECTORS_SHIFT;
+		unsigned int offset = (sector & (RS_PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		size_t len = min_t(size_t, n, PAGE_SIZE - offset);
+
+		if (len == PAGE_SIZE)
+			ret = rd_write_full(rs, idx, src, gfp);
+		else
+			ret = rd_write_partial(rs, idx, offset, src, len, gfp);
+		if (ret)
+			return ret;
+		src += len;
+		n -= len;
+		sector += len >> SECTOR_SHIFT;
+	}
+	return 0;
+}
+
+/*
+ * Like ram_comp_zero(): discard can't fail, and unsharing a page needs
+ * one. The disk is in process context (BLK_MQ_F_BLOCKING with dedup).
+ */
+void ram_dedup_zero(struct ram_store *rs, pgoff_t idx, unsigned int offset, size_t len)
+{
+	rd_write_partial(rs, idx, offset, NULL, len, GFP_NOIO | __GFP_NOFAIL);
+}
+
+void ram_dedup_release(struct ram_store *rs, struct page *page)
+{
+	atomic_long_dec(&rs->dedup->logical_pages);
+	rd_put(rs, page);
+}
+
+int ram_dedup_fill(struct ram_store *rs, pgoff_t idx, const void *src, gfp_t gfp)
+{
+	struct page *page, *cur;
+
+	page = rd_get(rs, src, gfp);
+	if (!page)
+		return -ENOMEM;
+	cur = xa_cmpxchg(&rs->pages, idx, NULL, page, gfp);
+	if (unlikely(cur)) {
+		rd_put(rs, page);
+		return xa_is_err(cur) ? xa_err(cur) : 0;
+	}
+	atomic_long_inc(&rs->dedup->logical_pages);
+	return 0;
+}
+
+void ram_dedup_get_stats(struct ram_store *rs, struct ram_dedup_stats *st)
+{
+	struct ram_dedup *d = rs->dedup;
+
+	st->logical_pages = atomic_long_read(&d->logical_pages);
+	st->unique_pages = ram_store_pages(rs);
+	st->shared_pages = atomic_long_read(&d->shared_pages);
+	st->dup_hits = atomic64_read(&d->dup_hits);
+	st->collisions = atomic64_read(&d->collisions);
+	st->cow_breaks = atomic64_read(&d->cow_breaks);
+}
+
+int ram_dedup_init(struct ram_store *rs, unsigned long nr_pages)
+{
+	struct ram_dedup *d;
+	int i;
+
+	d = kzalloc(sizeof(*d), GFP_KERNEL);
+	if (!d)
+		return -ENOMEM;
+	/* About one page per bucket; a disk that grows later just gets longer chains */
+	d->bits = clamp_t(unsigned int, order_base_2(nr_pages), RD_MIN_BITS, RD_MAX_BITS);
+	d->table = kvcalloc(1UL << d->bits, sizeof(*d->table), GFP_KERNEL);
+	if (!d->table) {
+		kfree(d);
+		return -ENOMEM;
+	}
+	for (i = 0; i < RD_LOCKS; i++)
+		spin_lock_init(&d->locks[i]);
+	rs->dedup = d;
+	return 0;
+}
+
+void ram_dedup_free(struct ram_store *rs)
+{
+	struct ram_dedup *d = rs->dedup;
+	struct page *page;
+	unsigned long idx;
+
+	if (!d)
+		return;
+	xa_for_each(&rs->pages, idx, page) {
+		rd_put(rs, page);
+		cond_resched();
+	}
+	xa_destroy(&rs->pages);
+	kvfree(d->table);
+	kfree(d);
+	rs->dedup = NULL;
+}
+
+#else /* !CONFIG_XXHASH */
+
+int ram_dedup_init(struct ram_store *rs, unsigned long nr_pages)
+{
+	pr_err("%s: dedup needs a kernel with CONFIG_XXHASH\n", __func__);
+	return -EOPNOTSUPP;
+}
+
+void ram_dedup_free(struct ram_store *rs)
+{
+}
+
+int ram_dedup_write(struct ram_store *rs, sector_t sector, const void *src, size_t n, gfp_t gfp)
+{
+	return -EIO;
+}
+
+void ram_dedup_zero(struct ram_store *rs, pgoff_t idx, unsigned int offset, size_t len)
+{
+}
+
+void ram_dedup_release(struct ram_store *rs, struct page *page)
+{
+}
+
+int ram_dedup_fill(struct ram_store *rs, pgoff_t idx, const void *src, gfp_t gfp)
+{
+	return -EIO;
+}
+
+void ram_dedup_get_stats(struct ram_store *rs, struct ram_dedup_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+}
+
+#endif
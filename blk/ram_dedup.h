@@ -0,0 +1,48 @@
+/*
+ * Content addressed deduplication for the RAM store
+ *
+ * Every whole page write is hashed (xxh64) and looked up in a table of
+ * the pages already stored; on a hash match the data is compared in full
+ * and, if equal, the xarray slot simply points at the existing page and
+ * takes a reference. Otherwise a new page is stored and hashed for the
+ * next writer. RAM use then follows the unique data: a disk filled with
+ * copies of the same image costs one copy.
+ *
+ * A hashed page is never written again. A partial write breaks sharing:
+ * the page is copied, changed and swapped into the slot as a private,
+ * unhashed page that later partial writes change in place, until a whole
+ * page write hashes the slot again.
+ *
+ * Shared pages aren't placed by the NUMA policy (they belong to several
+ * page indexes) and non-temporal writes copy as usual. A slot dropped by
+ * discard or overwrite releases its reference; the last one frees the
+ * page after an RCU grace period, like ram_store_discard().
+ */
+#ifndef _RAM_DEDUP_H_
+#define _RAM_DEDUP_H_
+
+#include "ram_store.h"
+
+struct ram_dedup_stats {
+	u64 logical_pages;	/* page indexes holding data */
+	u64 unique_pages;	/* pages of memory behind them */
+	u64 shared_pages;	/* hashed pages, referenced by one index or more */
+	u64 dup_hits;		/* page writes that found their data already stored */
+	u64 collisions;		/* hash matches with different data */
+	u64 cow_breaks;		/* partial writes that had to unshare a page */
+};
+
+/* nr_pages sizes the hash table: the disk's size in pages */
+int ram_dedup_init(struct ram_store *rs, unsigned long nr_pages);
+/* Leaves the xarray empty */
+void ram_dedup_free(struct ram_store *rs);
+int ram_dedup_write(struct ram_store *rs, sector_t sector, const void *src, size_t n, gfp_t gfp);
+/* Zero len bytes at offset of page idx, if it is backed */
+void ram_dedup_zero(struct ram_store *rs, pgoff_t idx, unsigned int offset, size_t len);
+/* idx was taken out of the xarray: drop its reference to page */
+void ram_dedup_release(struct ram_store *rs, struct page *page);
+/* ram_store_fill_page() */
+int ram_dedup_fill(struct ram_store *rs, pgoff_t idx, const void *src, gfp_t gfp);
+void ram_dedup_get_stats(struct ram_store *rs, struct ram_dedup_stats *st);
+
+#endif
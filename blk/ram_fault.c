@@ -0,0 +1,479 @@
+/*
+ * Fault and latency injection for the RAM block drivers, see ram_fault.h
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/random.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+
+#include "ram_fault.h"
+
+#define RF_HIST_MAX	64		/* Histogram buckets */
+#define RF_MAX_RANGES	16		/* Error ranges */
+
+enum {
+	RF_DELAY_OFF,
+	RF_DELAY_FIXED,
+	RF_DELAY_UNIFORM,
+	RF_DELAY_HIST,
+};
+
+struct rf_delay {
+	int mode;
+	u64 min_ns;			/* fixed: the delay */
+	u64 max_ns;
+	unsigned int nr;		/* hist: buckets */
+	u64 ns[RF_HIST_MAX];		/* Upper bounds, ascending */
+	u64 cum[RF_HIST_MAX];		/* Running sum of the weights */
+};
+
+struct rf_range {
+	sector_t first;
+	sector_t last;
+	unsigned int dirs;		/* BIT(READ) | BIT(WRITE) */
+	unsigned int every;
+	atomic_t seen;			/* I/Os touching the range */
+	atomic_t failed;
+};
+
+/* Never changed once published: writers build a new one and swap it in */
+struct rf_config {
+	struct rcu_head rcu;
+	struct rf_delay delay[2];
+	u64 bw[2];			/* bytes per second, 0: no cap */
+	unsigned int nr_ranges;
+	struct rf_range range[RF_MAX_RANGES];
+};
+
+static const char * const rf_dir_name[2] = { "read", "write" };
+
+int ram_fault_error(struct ram_fault *f, int dir, sector_t sector, unsigned int nr)
+{
+	struct rf_config *cfg;
+	unsigned int i;
+	int ret = 0;
+
+	rcu_read_lock();
+	cfg = rcu_dereference(f->cfg);
+	for (i = 0; cfg && i < cfg->nr_ranges; i++) {
+		struct rf_range *r = &cfg->range[i];
+
+		if (!(r->dirs & BIT(dir)) || sector > r->last || sector + nr <= r->first)
+			continue;
+		if ((unsigned int)atomic_inc_return(&r->seen) % r->every)
+			continue;
+		atomic_inc(&r->failed);
+		ret = -EIO;
+		break;
+	}
+	rcu_read_unlock();
+	return ret;
+}
+
+/* A fraction of span, [0, span) */
+static u64 rf_rand(u64 span)
+{
+	return mul_u64_u32_shr(span, prandom_u32(), 32);
+}
+
+static u64 rf_draw(const struct rf_delay *d)
+{
+	unsigned int i;
+	u64 w, lo;
+
+	switch (d->mode) {
+	case RF_DELAY_FIXED:
+		return d->min_ns;
+	case RF_DELAY_UNIFORM:
+		return d->min_ns + rf_rand(d->max_ns - d->min_ns + 1);
+	case RF_DELAY_HIST:
+		w = rf_rand(d->cum[d->nr - 1]);
+		for (i = 0; w >= d->cum[i]; i++)
+			;
+		lo = i ? d->ns[i - 1] : 0;
+		return lo + rf_rand(d->ns[i] - lo + 1);
+	}
+	return 0;
+}
+
+u64 ram_fault_delay(struct ram_fault *f, int dir, unsigned int bytes)
+{
+	struct rf_config *cfg;
+	u64 ns = 0, bw = 0, now, cost, old, new;
+
+	rcu_read_lock();
+	cfg = rcu_dereference(f->cfg);
+	if (cfg) {
+		ns = rf_draw(&cfg->delay[dir]);
+		bw = cfg->bw[dir];
+	}
+	rcu_read_unlock();
+	if (!bw || !bytes)
+		return ns;
+	/* Take the next slot of the virtual clock: after whatever is queued, or now if it's idle */
+	now = ktime_get_ns();
+	cost = div64_u64((u64)bytes * NSEC_PER_SEC, bw);
+	do {
+		old = atomic64_read(&f->bw_next[dir]);
+		new = max(old, now) + cost;
+	} while (atomic64_cmpxchg(&f->bw_next[dir], old, new) != old);
+	return ns + (new - now);
+}
+
+/* Next whitespace separated word of *s, NULL at the end */
+static char *rf_token(char **s)
+{
+	char *t;
+
+	do {
+		t = strsep(s, " \t\n");
+	} while (t && !*t);
+	return t;
+}
+
+/*
+ * Optional leading "read" or "write": returns the directions and leaves
+ * the word after it in *tok.
+ */
+static unsigned int rf_dirs(char **s, char **tok)
+{
+	*tok = rf_token(s);
+	if (*tok && !strcmp(*tok, "read")) {
+		*tok = rf_token(s);
+		return BIT(READ);
+	}
+	if (*tok && !strcmp(*tok, "write")) {
+		*tok = rf_token(s);
+		return BIT(WRITE);
+	}
+	return BIT(READ) | BIT(WRITE);
+}
+
+static int rf_parse_delay(struct rf_delay *d, const char *mode, char **s)
+{
+	char *tok, *w;
+	u64 weight, sum = 0;
+	int ret;
+
+	memset(d, 0, sizeof(*d));
+	if (!mode)
+		return -EINVAL;
+	if (!strcmp(mode, "off"))
+		return 0;
+	if (!strcmp(mode, "fixed")) {
+		d->mode = RF_DELAY_FIXED;
+		tok = rf_token(s);
+		return tok ? kstrtoull(tok, 0, &d->min_ns) : -EINVAL;
+	}
+	if (!strcmp(mode, "uniform")) {
+		d->mode = RF_DELAY_UNIFORM;
+		tok = rf_token(s);
+		ret = tok ? kstrtoull(tok, 0, &d->min_ns) : -EINVAL;
+		tok = rf_token(s);
+		if (!ret)
+			ret = tok ? kstrtoull(tok, 0, &d->max_ns) : -EINVAL;
+		return !ret && d->max_ns < d->min_ns ? -EINVAL : ret;
+	}
+	if (strcmp(mode, "hist"))
+		return -EINVAL;
+	d->mode = RF_DELAY_HIST;
+	while ((tok = rf_token(s))) {
+		if (d->nr == RF_HIST_MAX)
+			return -E2BIG;
+		w = strchr(tok, ':');
+		if (!w)
+			return -EINVAL;
+		*w++ = '\0';
+		ret = kstrtoull(tok, 0, &d->ns[d->nr]);
+		if (!ret)
+			ret = kstrtoull(w, 0, &weight);
+		if (ret)
+			return ret;
+		if (!weight || (d->nr && d->ns[d->nr] <= d->ns[d->nr - 1]))
+			return -EINVAL;
+		sum += weight;
+		d->cum[d->nr++] = sum;
+	}
+	return d->nr ? 0 : -EINVAL;
+}
+
+static int rf_change_delay(struct rf_config *cfg, char *s)
+{
+	unsigned int dirs;
+	char *mode;
+	int ret;
+
+	dirs = rf_dirs(&s, &mode);
+	ret = rf_parse_delay(&cfg->delay[dirs & BIT(READ) ? READ : WRITE], mode, &s);
+	if (!ret && dirs == (BIT(READ) | BIT(WRITE)))
+		cfg->delay[WRITE] = cfg->delay[READ];
+	return ret;
+}
+
+static int rf_change_bw(struct rf_config *cfg, char *s)
+{
+	unsigned int dirs;
+	char *tok, *end;
+	u64 bw;
+
+	dirs = rf_dirs(&s, &tok);
+	if (!tok)
+		return -EINVAL;
+	bw = memparse(tok, &end);
+	if (*end)
+		return -EINVAL;
+	if (dirs & BIT(READ))
+		cfg->bw[READ] = bw;
+	if (dirs & BIT(WRITE))
+		cfg->bw[WRITE] = bw;
+	return 0;
+}
+
+/* One range per line */
+static int rf_change_errors(struct rf_config *cfg, char *s)
+{
+	char *line, *tok, *last;
+	struct rf_range *r;
+	unsigned long long first, end;
+	int ret;
+
+	while ((line = strsep(&s, "\n"))) {
+		tok = rf_token(&line);
+		if (!tok)
+			continue;
+		if (!strcmp(tok, "clear")) {
+			cfg->nr_ranges = 0;
+			continue;
+		}
+		if (cfg->nr_ranges == RF_MAX_RANGES)
+			return -E2BIG;
+		last = strchr(tok, '-');
+		if (!last)
+			return -EINVAL;
+		*last++ = '\0';
+		ret = kstrtoull(tok, 0, &first);
+		if (!ret)
+			ret = kstrtoull(last, 0, &end);
+		if (ret)
+			return ret;
+		if (end < first)
+			return -EINVAL;
+		r = &cfg->range[cfg->nr_ranges];
+		memset(r, 0, sizeof(*r));
+		r->first = first;
+		r->last = end;
+		r->dirs = rf_dirs(&line, &tok);
+		r->every = 1;
+		if (tok) {
+			ret = kstrtouint(tok, 0, &r->every);
+			if (ret)
+				return ret;
+			if (!r->every)
+				return -EINVAL;
+		}
+		cfg->nr_ranges++;
+	}
+	return 0;
+}
+
+static bool rf_config_idle(const struct rf_config *cfg)
+{
+	return cfg->delay[READ].mode == RF_DELAY_OFF && cfg->delay[WRITE].mode == RF_DELAY_OFF &&
+		!cfg->bw[READ] && !cfg->bw[WRITE] && !cfg->nr_ranges;
+}
+
+/*
+ * Copy the current configuration, let change() edit the copy with the
+ * user's text and publish it. A configuration that injects nothing is
+ * published as NULL so the I/O path stays a pointer test.
+ */
+static ssize_t rf_update(struct ram_fault *f, const char __user *ubuf, size_t count,
+		int (*change)(struct rf_config *, char *))
+{
+	struct rf_config *old, *new;
+	char *buf;
+	int ret;
+
+	if (count > PAGE_SIZE)
+		return -E2BIG;
+	buf = memdup_user_nul(ubuf, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+	if (!new) {
+		ret = -ENOMEM;
+		goto free_buf;
+	}
+	mutex_lock(&f->lock);
+	old = rcu_dereference_protected(f->cfg, lockdep_is_held(&f->lock));
+	if (old)
+		memcpy(new, old, sizeof(*new));
+	ret = change(new, buf);
+	if (ret) {
+		kfree(new);
+		goto unlock;
+	}
+	if (rf_config_idle(new)) {
+		kfree(new);
+		new = NULL;
+	}
+	rcu_assign_pointer(f->cfg, new);
+	if (old)
+		kfree_rcu(old, rcu);
+unlock:
+	mutex_unlock(&f->lock);
+free_buf:
+	kfree(buf);
+	return ret ? ret : count;
+}
+
+static int rf_delay_show(struct seq_file *m, void *v)
+{
+	struct ram_fault *f = m->private;
+	struct rf_config *cfg;
+	unsigned int i;
+	int d;
+
+	mutex_lock(&f->lock);
+	cfg = rcu_dereference_protected(f->cfg, lockdep_is_held(&f->lock));
+	for (d = READ; d <= WRITE; d++) {
+		const struct rf_delay *dl = cfg ? &cfg->delay[d] : NULL;
+
+		seq_printf(m, "%s:", rf_dir_name[d]);
+		if (!dl || dl->mode == RF_DELAY_OFF)
+			seq_puts(m, " off");
+		else if (dl->mode == RF_DELAY_FIXED)
+			seq_printf(m, " fixed %llu", dl->min_ns);
+		else if (dl->mode == RF_DELAY_UNIFORM)
+			seq_printf(m, " uniform %llu %llu", dl->min_ns, dl->max_ns);
+		else {
+			seq_puts(m, " hist");
+			for (i = 0; i < dl->nr; i++)
+				seq_printf(m, " %llu:%llu", dl->ns[i], dl->cum[i] - (i ? dl->cum[i - 1] : 0));
+		}
+		seq_putc(m, '\n');
+	}
+	mutex_unlock(&f->lock);
+	return 0;
+}
+
+static int rf_bw_show(struct seq_file *m, void *v)
+{
+	struct ram_fault *f = m->private;
+	struct rf_config *cfg;
+	int d;
+
+	mutex_lock(&f->lock);
+	cfg = rcu_dereference_protected(f->cfg, lockdep_is_held(&f->lock));
+	for (d = READ; d <= WRITE; d++)
+		seq_printf(m, "%s: %llu\n", rf_dir_name[d], cfg ? cfg->bw[d] : 0);
+	mutex_unlock(&f->lock);
+	return 0;
+}
+
+static int rf_errors_show(struct seq_file *m, void *v)
+{
+	struct ram_fault *f = m->private;
+	struct rf_config *cfg;
+	unsigned int i;
+
+	mutex_lock(&f->lock);
+	cfg = rcu_dereference_protected(f->cfg, lockdep_is_held(&f->lock));
+	for (i = 0; cfg && i < cfg->nr_ranges; i++) {
+		struct rf_range *r = &cfg->range[i];
+
+		seq_printf(m, "%llu-%llu %s every %u: seen %u failed %u\n",
+			(unsigned long long)r->first, (unsigned long long)r->last,
+			r->dirs == BIT(READ) ? "read" : r->dirs == BIT(WRITE) ? "write" : "rw",
+			r->every, atomic_read(&r->seen), atomic_read(&r->failed));
+	}
+	mutex_unlock(&f->lock);
+	return 0;
+}
+
+static ssize_t rf_delay_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+
+	return rf_update(m->private, buf, count, rf_change_delay);
+}
+
+static ssize_t rf_bw_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+
+	return rf_update(m->private, buf, count, rf_change_bw);
+}
+
+static ssize_t rf_errors_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+
+	return rf_update(m->private, buf, count, rf_change_errors);
+}
+
+static int rf_delay_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rf_delay_show, inode->i_private);
+}
+
+static int rf_bw_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rf_bw_show, inode->i_private);
+}
+
+static int rf_errors_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rf_errors_show, inode->i_private);
+}
+
+static const struct file_operations rf_delay_fops = {
+	.owner   = THIS_MODULE,
+	.open    = rf_delay_open,
+	.read    = seq_read,
+	.write   = rf_delay_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations rf_bw_fops = {
+	.owner   = THIS_MODULE,
+	.open    = rf_bw_open,
+	.read    = seq_read,
+	.write   = rf_bw_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations rf_errors_fops = {
+	.owner   = THIS_MODULE,
+	.open    = rf_errors_open,
+	.read    = seq_read,
+	.write   = rf_errors_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+void ram_fault_init(struct ram_fault *f, struct dentry *dir)
+{
+	RCU_INIT_POINTER(f->cfg, NULL);
+	mutex_init(&f->lock);
+	atomic64_set(&f->bw_next[READ], 0);
+	atomic64_set(&f->bw_next[WRITE], 0);
+	/* Best effort like the statistics next to them */
+	debugfs_create_file("delay", 0600, dir, f, &rf_delay_fops);
+	debugfs_create_file("bandwidth", 0600, dir, f, &rf_bw_fops);
+	debugfs_create_file("errors", 0600, dir, f, &rf_errors_fops);
+}
+
+void ram_fault_exit(struct ram_fault *f)
+{
+	kfree(rcu_dereference_protected(f->cfg, true));
+	RCU_INIT_POINTER(f->cfg, NULL);
+}
@@ -0,0 +1,56 @@
+/*
+ * Fault and latency injection for the RAM block drivers
+ *
+ * Makes a disk behave like a real one on demand. Three debugfs files sit
+ * next to the statistics, all off by default:
+ *
+ *	/sys/kernel/debug/vd/<disk>/delay	[read|write] off
+ *						[read|write] fixed <ns>
+ *						[read|write] uniform <min_ns> <max_ns>
+ *						[read|write] hist <ns>:<weight> ...
+ *	/sys/kernel/debug/vd/<disk>/bandwidth	[read|write] <bytes/s, K/M/G suffix, 0: no cap>
+ *	/sys/kernel/debug/vd/<disk>/errors	<first>-<last> [read|write] [<n>]
+ *						clear
+ *
+ * Without read or write a line sets both directions. A histogram bucket
+ * <ns>:<weight> (ascending ns) draws a delay uniformly between the bucket
+ * before's ns, or 0, and ns, weight times as often as a bucket of weight
+ * 1, so a measured latency distribution can be replayed. The bandwidth
+ * cap is a virtual clock per direction: an I/O occupies it for bytes /
+ * rate and completes when its turn is over, on top of the drawn delay.
+ * An errors line fails every n-th (default: every) I/O touching sectors
+ * first..last with -EIO, before anything is copied; reading the file
+ * shows how often each range was hit.
+ *
+ * The driver holds a delayed completion on an hrtimer, nothing spins.
+ * The configuration is swapped under RCU, the I/O path takes no lock.
+ */
+#ifndef _RAM_FAULT_H_
+#define _RAM_FAULT_H_
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+
+struct rf_config;
+
+struct ram_fault {
+	struct rf_config __rcu *cfg;		/* NULL: nothing injected */
+	struct mutex lock;			/* Writers of cfg */
+	atomic64_t bw_next[2];			/* READ/WRITE: ns the virtual clock is busy until */
+};
+
+/* Creates the control files in dir (the disk's statistics directory) */
+void ram_fault_init(struct ram_fault *f, struct dentry *dir);
+/* The files must be gone already, see ram_stats_exit() */
+void ram_fault_exit(struct ram_fault *f);
+
+/* -EIO when an injected error covers nr sectors at sector for dir (READ/WRITE) */
+int ram_fault_error(struct ram_fault *f, int dir, sector_t sector, unsigned int nr);
+/* ns to hold the completion of an I/O of bytes in dir, 0: complete now */
+u64 ram_fault_delay(struct ram_fault *f, int dir, unsigned int bytes);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * Save / restore the contents of a RAM store to a file, see ram_image.h
+ */
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+
+#include "ram_image.h"
+
+#define RI_MAGIC	0x31474d4944524dULL	/* "MRDIMG1" */
+#define RI_VERSION	1
+#define RI_ALIGN	4096			/* Page data starts on a file system block */
+#define RI_CHUNK	(1 << 20)		/* Bytes per kernel_read/kernel_write */
+
+struct ri_header {
+	__le64 magic;
+	__le32 version;
+	__le32 page_size;
+	__le64 capacity;			/* sectors */
+	__le64 nr_extents;
+	__le64 nr_pages;
+};
+
+struct ri_extent {
+	__le64 index;				/* first page */
+	__le64 count;				/* pages */
+};
+
+static int ri_write(struct file *file, const void *buf, size_t n, loff_t *pos)
+{
+	ssize_t ret;
+
+	while (n) {
+		ret = kernel_write(file, buf, n, pos);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			return -EIO;
+		buf += ret;
+		n -= ret;
+	}
+	return 0;
+}
+
+static int ri_read(struct file *file, void *buf, size_t n, loff_t *pos)
+{
+	ssize_t ret;
+
+	while (n) {
+		ret = kernel_read(file, buf, n, pos);
+		if (ret < 0)
+			return ret;
+		if (!ret)                                       /* Truncated image */
+			return -EINVAL;
+		buf += ret;
+		n -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Next run of backed pages at or after *idx: returns its length and
+ * leaves its first page in *idx, 0 when there is none.
+ */
+static unsigned long ri_next_extent(struct ram_store *rs, unsigned long *idx)
+{
+	unsigned long next;
+
+	if (!xa_find(&rs->pages, idx, ULONG_MAX, XA_PRESENT))
+		return 0;
+	next = *idx;
+	while (next < ULONG_MAX && xa_load(&rs->pages, next + 1))
+		next++;
+	return next - *idx + 1;
+}
+
+/* Copy count pages starting at page idx between the store and the file */
+static int ri_copy_extent(struct ram_store *rs, struct file *file, loff_t *pos, void *buf,
+		unsigned long idx, unsigned long count, bool save)
+{
+	sector_t sector = (sector_t)idx << RS_PAGE_SECTORS_SHIFT;
+	u64 left = (u64)count << PAGE_SHIFT;
+	int ret;
+
+	while (left) {
+		size_t len = min_t(u64, left, RI_CHUNK);
+
+		if (save) {
+			ram_store_read(rs, sector, buf, len);
+			ret = ri_write(file, buf, len, pos);
+		} else {
+			ret = ri_read(file, buf, len, pos);
+			if (!ret)
+				ret = ram_store_write(rs, sector, buf, len, GFP_KERNEL);
+		}
+		if (ret)
+			return ret;
+		sector += len >> SECTOR_SHIFT;
+		left -= len;
+		cond_resched();
+	}
+	return 0;
+}
+
+/*
+ * Two walks over the xarray: the first counts the extents so the page
+ * data can start right behind the map, the second writes map entries
+ * and data. The caller keeps the store quiet in between.
+ */
+int ram_image_save(struct ram_store *rs, sector_t capacity, const char *path)
+{
+	struct ri_header hdr = { };
+	struct ri_extent ext;
+	unsigned long i, idx, count, nr_extents = 0, nr_pages = 0;
+	loff_t map_pos, data_pos;
+	struct file *file;
+	void *buf;
+	int ret;
+
+	for (idx = 0; (count = ri_next_extent(rs, &idx)); idx += count) {
+		nr_extents++;
+		nr_pages += count;
+	}
+
+	buf = vmalloc(RI_CHUNK);
+	if (!buf)
+		return -ENOMEM;
+	file = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+	if (IS_ERR(file)) {
+		ret = PTR_ERR(file);
+		goto free_buf;
+	}
+	hdr.magic = cpu_to_le64(RI_MAGIC);
+	hdr.version = cpu_to_le32(RI_VERSION);
+	hdr.page_size = cpu_to_le32(PAGE_SIZE);
+	hdr.capacity = cpu_to_le64(capacity);
+	hdr.nr_extents = cpu_to_le64(nr_extents);
+	hdr.nr_pages = cpu_to_le64(nr_pages);
+	map_pos = 0;
+	ret = ri_write(file, &hdr, sizeof(hdr), &map_pos);
+	data_pos = ALIGN(sizeof(hdr) + nr_extents * sizeof(ext), RI_ALIGN);
+
+	for (i = 0, idx = 0; !ret && i < nr_extents; i++, idx += count) {
+		count = ri_next_extent(rs, &idx);
+		ext.index = cpu_to_le64(idx);
+		ext.count = cpu_to_le64(count);
+		ret = ri_write(file, &ext, sizeof(ext), &map_pos);
+		if (!ret)
+			ret = ri_copy_extent(rs, file, &data_pos, buf, idx, count, true);
+	}
+	if (!ret)
+		ret = vfs_fsync(file, 0);
+	filp_close(file, NULL);
+	if (!ret)
+		pr_info("%s: saved %lu pages to %s\n", __func__, nr_pages, path);
+free_buf:
+	vfree(buf);
+	return ret;
+}
+
+int ram_image_load(struct ram_store *rs, const char *path, sector_t *capacity)
+{
+	struct ri_header hdr;
+	struct ri_extent ext;
+	u64 i, nr_extents, pages_max, end = 0;
+	loff_t map_pos = 0, data_pos;
+	struct file *file;
+	void *buf;
+	int ret;
+
+	file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	buf = vmalloc(RI_CHUNK);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto close;
+	}
+	ret = ri_read(file, &hdr, sizeof(hdr), &map_pos);
+	if (ret)
+		goto free_buf;
+	if (le64_to_cpu(hdr.magic) != RI_MAGIC || le32_to_cpu(hdr.version) != RI_VERSION ||
+	    le32_to_cpu(hdr.page_size) != PAGE_SIZE || !hdr.capacity) {
+		pr_err("%s: %s is not an image of this driver (or of another page size)\n", __func__, path);
+		ret = -EINVAL;
+		goto free_buf;
+	}
+	nr_extents = le64_to_cpu(hdr.nr_extents);
+	pages_max = DIV_ROUND_UP_ULL(le64_to_cpu(hdr.capacity), RS_PAGE_SECTORS);
+	data_pos = ALIGN(sizeof(hdr) + nr_extents * sizeof(ext), RI_ALIGN);
+
+	for (i = 0; i < nr_extents; i++) {
+		u64 idx, count;
+
+		ret = ri_read(file, &ext, sizeof(ext), &map_pos);
+		if (ret)
+			break;
+		idx = le64_to_cpu(ext.index);
+		count = le64_to_cpu(ext.count);
+		if (!count || idx < end || idx >= pages_max || count > pages_max - idx) {
+			pr_err("%s: %s: bad extent %llu (+%llu)\n", __func__, path, idx, count);
+			ret = -EINVAL;
+			break;
+		}
+		ret = ri_copy_extent(rs, file, &data_pos, buf, idx, count, false);
+		if (ret)
+			break;
+		end = idx + count;
+	}
+	if (!ret) {
+		*capacity = le64_to_cpu(hdr.capacity);
+		pr_info("%s: restored %llu pages from %s\n", __func__,
+			(unsigned long long)le64_to_cpu(hdr.nr_pages), path);
+	}
+free_buf:
+	vfree(buf);
+close:
+	filp_close(file, NULL);
+	return ret;
+}
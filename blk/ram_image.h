@@ -0,0 +1,28 @@
+/*
+ * Save / restore the contents of a RAM store to a file
+ *
+ * Image layout (little endian), only the pages that hold data are kept:
+ *
+ *	struct ri_header
+ *	struct ri_extent[nr_extents]	runs of backed pages, ascending
+ *	(zero padding up to RI_ALIGN)
+ *	page data of every extent, back to back
+ *
+ * Both directions stream through a large buffer with kernel_read() /
+ * kernel_write(), so a warm disk comes back at the file's sequential
+ * bandwidth and holes cost nothing on either side.
+ */
+#ifndef _RAM_IMAGE_H_
+#define _RAM_IMAGE_H_
+
+#include "ram_store.h"
+
+/* Write every backed page of rs to path, which is created or truncated */
+int ram_image_save(struct ram_store *rs, sector_t capacity, const char *path);
+/*
+ * Fill the empty store rs from path and return the disk size it was
+ * saved with in *capacity. -ENOENT when there is no image yet.
+ */
+int ram_image_load(struct ram_store *rs, const char *path, sector_t *capacity);
+
+#endif
@@ -0,0 +1,370 @@
+/*
+ * Partition table generator for the RAM block drivers, see ram_part.h
+ */
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/random.h>
+#include <linux/uuid.h>
+#include <linux/crc32.h>
+#include <asm/unaligned.h>
+
+#include "ram_part.h"
+
+#define RP_MBR_SIGNATURE	0xAA55
+#define RP_MBR_SIG_OFFSET	510
+#define RP_MBR_ID_OFFSET	440
+#define RP_MBR_TABLE_OFFSET	446
+#define RP_TYPE_LINUX		0x83
+#define RP_TYPE_EXTENDED	0x05
+#define RP_TYPE_GPT		0xEE
+
+#define RP_GPT_SIGNATURE	0x5452415020494645ULL	/* "EFI PART" */
+#define RP_GPT_REVISION		0x00010000
+#define RP_GPT_ENTRIES		128
+#define RP_GPT_ENTRIES_SIZE	(RP_GPT_ENTRIES * sizeof(struct rp_gpt_entry))
+
+struct rp_mbr_part {
+	u8 boot;
+	u8 chs_start[3];
+	u8 type;
+	u8 chs_end[3];
+	__le32 lba_start;			/* relative to the table's sector for an EBR */
+	__le32 lba_count;
+} __packed;
+
+struct rp_gpt_header {
+	__le64 signature;
+	__le32 revision;
+	__le32 header_size;
+	__le32 header_crc32;
+	__le32 reserved;
+	__le64 my_lba;
+	__le64 alternate_lba;
+	__le64 first_usable_lba;
+	__le64 last_usable_lba;
+	guid_t disk_guid;
+	__le64 entries_lba;
+	__le32 nr_entries;
+	__le32 entry_size;
+	__le32 entries_crc32;
+} __packed;
+
+struct rp_gpt_entry {
+	guid_t type;
+	guid_t unique;
+	__le64 first_lba;
+	__le64 last_lba;
+	__le64 attributes;
+	__le16 name[36];			/* UTF-16LE */
+} __packed;
+
+static const guid_t rp_linux_fs_guid =
+	GUID_INIT(0x0FC63DAF, 0x8483, 0x4772, 0x8E, 0x79, 0x3D, 0x69, 0xD8, 0xE4, 0x7D, 0xE4);
+
+/* All numbers in logical blocks */
+struct rp_layout {
+	bool gpt;
+	int nr;
+	u64 start[RP_MAX_PARTS];
+	u64 len[RP_MAX_PARTS];
+	u64 ebr[RP_MAX_PARTS];			/* MBR logical partitions: their EBR */
+};
+
+static u32 rp_crc32(const void *buf, size_t len)
+{
+	return crc32_le(~0U, buf, len) ^ ~0U;		/* As the UEFI spec (and efi_crc32()) wants it */
+}
+
+/* CHS for the drivers' fake 1 head x 32 sectors geometry, the LBA only marker beyond it */
+static void rp_chs(u64 lba, u8 *chs)
+{
+	u64 c = lba / 32;
+	unsigned int h = 0, s = lba % 32 + 1;
+
+	if (c > 1023) {
+		c = 1023;
+		h = 254;
+		s = 63;
+	}
+	chs[0] = h;
+	chs[1] = (s & 0x3f) | ((c >> 2) & 0xc0);
+	chs[2] = c & 0xff;
+}
+
+static void rp_mbr_entry(struct rp_mbr_part *p, u8 type, u64 start, u64 len, u64 base)
+{
+	p->boot = 0;
+	p->type = type;
+	rp_chs(start, p->chs_start);
+	rp_chs(start + len - 1, p->chs_end);
+	p->lba_start = cpu_to_le32(start - base);
+	p->lba_count = cpu_to_le32(len);
+}
+
+/*
+ * Turn spec into partition extents inside [first, last]. Sizes are in
+ * bytes and rounded down to align; a count splits what is left after
+ * the EBR slots evenly.
+ */
+static int rp_parse(const char *spec, u64 first, u64 last, unsigned int lbs, u64 align,
+		bool gpt, struct rp_layout *l)
+{
+	u64 size[RP_MAX_PARTS], pos, avail, share = 0;
+	char *buf, *tok, *cur, *end;
+	unsigned long count;
+	int i, nr = 0, ret = 0;
+
+	buf = kstrdup(spec, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	cur = strim(buf);
+	if (!kstrtoul(cur, 10, &count)) {               /* A plain count */
+		if (!count || count > RP_MAX_PARTS) {
+			ret = -EINVAL;
+			goto out;
+		}
+		nr = count;
+		for (i = 0; i < nr; i++)
+			size[i] = 0;
+	} else {
+		while ((tok = strsep(&cur, ",")) != NULL) {
+			if (nr == RP_MAX_PARTS) {
+				ret = -EINVAL;
+				goto out;
+			}
+			tok = strim(tok);
+			if (!strcmp(tok, "-")) {
+				if (cur) {                      /* Only the last one takes the rest */
+					ret = -EINVAL;
+					goto out;
+				}
+				size[nr++] = U64_MAX;
+				continue;
+			}
+			size[nr] = memparse(tok, &end) / lbs / align * align;
+			if (*end || !size[nr]) {
+				pr_err("%s: bad partition size \"%s\" (at least one alignment unit)\n", __func__, tok);
+				ret = -EINVAL;
+				goto out;
+			}
+			nr++;
+		}
+		count = 0;
+	}
+	if (!gpt && nr > RP_MAX_MBR_PARTS) {
+		pr_err("%s: an MBR holds at most %d partitions here\n", __func__, RP_MAX_MBR_PARTS);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	pos = round_up(first, align);
+	if (pos > last) {
+		ret = -ENOSPC;
+		goto out;
+	}
+	avail = last + 1 - pos;
+	if (count) {
+		u64 ebrs = (!gpt && nr > 4) ? (nr - 3) * align : 0;
+
+		share = avail > ebrs ? (avail - ebrs) / nr / align * align : 0;
+		if (!share) {
+			ret = -ENOSPC;
+			goto out;
+		}
+	}
+	for (i = 0; i < nr; i++) {
+		u64 len;
+
+		if (!gpt && nr > 4 && i >= 3) {
+			l->ebr[i] = pos;                        /* This logical partition's EBR */
+			pos += align;
+		}
+		if (count)
+			len = share;
+		else if (size[i] == U64_MAX)
+			len = pos <= last ? (last + 1 - pos) / align * align : 0;
+		else
+			len = size[i];
+		if (!len || pos + len - 1 > last) {
+			ret = -ENOSPC;
+			goto out;
+		}
+		l->start[i] = pos;
+		l->len[i] = len;
+		pos += len;
+	}
+	l->nr = nr;
+out:
+	kfree(buf);
+	return ret;
+}
+
+static int rp_write_block(struct ram_store *rs, u64 lba, unsigned int lbs, const void *buf, size_t len)
+{
+	return ram_store_write(rs, lba * (lbs >> SECTOR_SHIFT), buf, len, GFP_KERNEL);
+}
+
+static int rp_write_mbr(struct ram_store *rs, unsigned int lbs, struct rp_layout *l, u8 *blk)
+{
+	struct rp_mbr_part *t = (struct rp_mbr_part *)(blk + RP_MBR_TABLE_OFFSET);
+	int i, nr_primary = l->nr > 4 ? 3 : l->nr, ret;
+	u64 ext_start = l->ebr[3], ext_end;
+
+	memset(blk, 0, lbs);
+	put_unaligned_le32(get_random_u32(), blk + RP_MBR_ID_OFFSET);
+	for (i = 0; i < nr_primary; i++)
+		rp_mbr_entry(&t[i], RP_TYPE_LINUX, l->start[i], l->len[i], 0);
+	if (l->nr > 4) {                                        /* From the first EBR to the last logical's end */
+		ext_end = l->start[l->nr - 1] + l->len[l->nr - 1];
+		rp_mbr_entry(&t[3], RP_TYPE_EXTENDED, ext_start, ext_end - ext_start, 0);
+	}
+	put_unaligned_le16(RP_MBR_SIGNATURE, blk + RP_MBR_SIG_OFFSET);
+	ret = rp_write_block(rs, 0, lbs, blk, lbs);
+	if (ret || l->nr <= 4)
+		return ret;
+
+	/*
+	 * EBR chain: each holds its logical partition (relative to the EBR)
+	 * and a link to the next EBR (relative to the extended partition).
+	 */
+	for (i = 3; i < l->nr; i++) {
+		memset(blk, 0, lbs);
+		rp_mbr_entry(&t[0], RP_TYPE_LINUX, l->start[i], l->len[i], l->ebr[i]);
+		if (i + 1 < l->nr)
+			rp_mbr_entry(&t[1], RP_TYPE_EXTENDED, l->ebr[i + 1],
+				l->start[i + 1] + l->len[i + 1] - l->ebr[i + 1], ext_start);
+		put_unaligned_le16(RP_MBR_SIGNATURE, blk + RP_MBR_SIG_OFFSET);
+		ret = rp_write_block(rs, l->ebr[i], lbs, blk, lbs);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void rp_gpt_header(struct rp_gpt_header *h, u64 my_lba, u64 alt_lba, u64 first, u64 last,
+		const guid_t *disk, u64 entries_lba, u32 entries_crc)
+{
+	memset(h, 0, sizeof(*h));
+	h->signature = cpu_to_le64(RP_GPT_SIGNATURE);
+	h->revision = cpu_to_le32(RP_GPT_REVISION);
+	h->header_size = cpu_to_le32(sizeof(*h));
+	h->my_lba = cpu_to_le64(my_lba);
+	h->alternate_lba = cpu_to_le64(alt_lba);
+	h->first_usable_lba = cpu_to_le64(first);
+	h->last_usable_lba = cpu_to_le64(last);
+	guid_copy(&h->disk_guid, disk);
+	h->entries_lba = cpu_to_le64(entries_lba);
+	h->nr_entries = cpu_to_le32(RP_GPT_ENTRIES);
+	h->entry_size = cpu_to_le32(sizeof(struct rp_gpt_entry));
+	h->entries_crc32 = cpu_to_le32(entries_crc);
+	h->header_crc32 = cpu_to_le32(rp_crc32(h, sizeof(*h)));
+}
+
+/* Protective MBR, primary header + entries at the front, backup copies at the end */
+static int rp_write_gpt(struct ram_store *rs, unsigned int lbs, u64 nblocks, u64 first, u64 last,
+		struct rp_layout *l, u8 *blk)
+{
+	u64 entries_blocks = RP_GPT_ENTRIES_SIZE / lbs;
+	struct rp_mbr_part *t = (struct rp_mbr_part *)(blk + RP_MBR_TABLE_OFFSET);
+	struct rp_gpt_entry *e;
+	guid_t disk;
+	u32 crc;
+	int i, j, ret;
+
+	e = kzalloc(RP_GPT_ENTRIES_SIZE, GFP_KERNEL);
+	if (!e)
+		return -ENOMEM;
+	for (i = 0; i < l->nr; i++) {
+		char name[16];
+
+		guid_copy(&e[i].type, &rp_linux_fs_guid);
+		guid_gen(&e[i].unique);
+		e[i].first_lba = cpu_to_le64(l->start[i]);
+		e[i].last_lba = cpu_to_le64(l->start[i] + l->len[i] - 1);
+		snprintf(name, sizeof(name), "ramdisk%d", i + 1);
+		for (j = 0; name[j]; j++)
+			e[i].name[j] = cpu_to_le16(name[j]);
+	}
+	crc = rp_crc32(e, RP_GPT_ENTRIES_SIZE);
+	guid_gen(&disk);
+
+	memset(blk, 0, lbs);
+	t[0].type = RP_TYPE_GPT;
+	t[0].chs_start[1] = 0x02;                               /* CHS 0/0/2, as the spec has it */
+	rp_chs(min_t(u64, nblocks - 1, 0xffffffffULL), t[0].chs_end);
+	t[0].lba_start = cpu_to_le32(1);
+	t[0].lba_count = cpu_to_le32(min_t(u64, nblocks - 1, 0xffffffffULL));
+	put_unaligned_le16(RP_MBR_SIGNATURE, blk + RP_MBR_SIG_OFFSET);
+	ret = rp_write_block(rs, 0, lbs, blk, lbs);
+	if (ret)
+		goto out;
+
+	memset(blk, 0, lbs);
+	rp_gpt_header((struct rp_gpt_header *)blk, 1, nblocks - 1, first, last, &disk, 2, crc);
+	ret = rp_write_block(rs, 1, lbs, blk, lbs);
+	if (!ret)
+		ret = rp_write_block(rs, 2, lbs, e, RP_GPT_ENTRIES_SIZE);
+	if (!ret)
+		ret = rp_write_block(rs, nblocks - 1 - entries_blocks, lbs, e, RP_GPT_ENTRIES_SIZE);
+	if (ret)
+		goto out;
+	memset(blk, 0, lbs);
+	rp_gpt_header((struct rp_gpt_header *)blk, nblocks - 1, 1, first, last, &disk,
+		nblocks - 1 - entries_blocks, crc);
+	ret = rp_write_block(rs, nblocks - 1, lbs, blk, lbs);
+out:
+	kfree(e);
+	return ret;
+}
+
+int ram_part_write(struct ram_store *rs, sector_t capacity, unsigned int lbs, const char *spec,
+		unsigned int align)
+{
+	u64 nblocks = (u64)capacity / (lbs >> SECTOR_SHIFT);
+	u64 align_blocks = max(align / lbs, 1U);
+	u64 first, last;
+	struct rp_layout *l;
+	bool gpt = false;
+	u8 *blk;
+	int ret;
+
+	if (!strncmp(spec, "gpt:", 4)) {
+		gpt = true;
+		spec += 4;
+	} else if (!strncmp(spec, "mbr:", 4)) {
+		spec += 4;
+	}
+	if (gpt) {                                              /* Room for both headers and entry arrays */
+		first = 2 + RP_GPT_ENTRIES_SIZE / lbs;
+		if (nblocks < 2 * first + 1)
+			return -ENOSPC;
+		last = nblocks - first;
+	} else {
+		first = 1;
+		last = min_t(u64, nblocks, 1ULL << 32) - 1;        /* 32 bit LBAs */
+	}
+	l = kzalloc(sizeof(*l), GFP_KERNEL);
+	blk = kzalloc(lbs, GFP_KERNEL);
+	if (!l || !blk) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = rp_parse(spec, first, last, lbs, align_blocks, gpt, l);
+	if (ret) {
+		pr_err("%s: layout \"%s\" doesn't fit a %llu block disk (%d)\n", __func__, spec, nblocks, ret);
+		goto out;
+	}
+	l->gpt = gpt;
+	if (gpt)
+		ret = rp_write_gpt(rs, lbs, nblocks, first, last, l, blk);
+	else
+		ret = rp_write_mbr(rs, lbs, l, blk);
+	if (!ret)
+		pr_info("%s: %s table with %d partitions, %llu block alignment\n", __func__,
+			gpt ? "GPT" : "MBR", l->nr, align_blocks);
+out:
+	kfree(blk);
+	kfree(l);
+	return ret;
+}
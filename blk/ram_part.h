@@ -0,0 +1,34 @@
+/*
+ * Partition table generator for the RAM block drivers
+ *
+ * Builds an MBR or a GPT for a disk of any size from a short layout
+ * spec, instead of the static tables of partition_info.h / ram.h that
+ * only fit a 1024 sector disk:
+ *
+ *	[mbr:|gpt:]<count>			<count> equal partitions
+ *	[mbr:|gpt:]<size>[,<size>...][,-]	K/M/G suffixed sizes, "-" is the rest
+ *
+ * e.g. "gpt:4", "mbr:64M,64M,-" or "1G,1G,1G,1G,-" (mbr is the default).
+ * Every partition starts and ends on an align boundary (1 MiB, like
+ * fdisk and parted, unless told otherwise). An MBR with more than four
+ * partitions gets three primaries plus an extended partition holding a
+ * chain of logical ones, each EBR one align unit ahead of its partition.
+ */
+#ifndef _RAM_PART_H_
+#define _RAM_PART_H_
+
+#include "ram_store.h"
+
+#define RP_MAX_PARTS	15		/* A disk owns 16 minors, the first is the whole disk */
+/* Past four, the extended partition takes number 4 and the logical ones follow it */
+#define RP_MAX_MBR_PARTS	14
+
+/*
+ * Write the table for spec into rs. capacity is in 512 byte sectors, lbs
+ * is the logical block size the table counts in, align is in bytes.
+ * -EINVAL for a bad spec, -ENOSPC when the partitions don't fit.
+ */
+int ram_part_write(struct ram_store *rs, sector_t capacity, unsigned int lbs, const char *spec,
+		unsigned int align);
+
+#endif
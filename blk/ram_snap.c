@@ -0,0 +1,149 @@
+/*
+ * Copy-on-write point in time snapshots of a RAM store, see ram_snap.h
+ */
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/gfp.h>
+#include <linux/slab.h>
+#include <linux/rculist.h>
+
+#include "ram_snap.h"
+
+#define RSN_HOLE	xa_mk_value(0)		/* Was never written when the snapshot was taken */
+
+struct ram_snap *ram_snap_alloc(void)
+{
+	struct ram_snap *s;
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return NULL;
+	INIT_LIST_HEAD(&s->node);
+	xa_init(&s->pages);
+	atomic_long_set(&s->nr_pages, 0);
+	return s;
+}
+
+void ram_snap_free(struct ram_snap *s)
+{
+	unsigned long idx;
+	void *entry;
+
+	xa_for_each(&s->pages, idx, entry) {
+		if (xa_is_value(entry))
+			continue;
+		if (s->heir && xa_load(&s->heir->pages, idx) == entry)
+			continue;                               /* Inherited */
+		__free_page(entry);
+	}
+	xa_destroy(&s->pages);
+	kfree(s);
+}
+
+int ram_snap_preserve(struct ram_snap *newest, struct ram_store *rs, sector_t sector, size_t n, gfp_t gfp)
+{
+	pgoff_t idx = sector >> RS_PAGE_SECTORS_SHIFT;
+	pgoff_t last = (sector + (n >> SECTOR_SHIFT) - 1) >> RS_PAGE_SECTORS_SHIFT;
+	struct page *page;
+	void *entry, *dst;
+	int ret;
+
+	for (; n && idx <= last; idx++) {
+		if (xa_load(&newest->pages, idx))
+			continue;                               /* Preserved since the snapshot */
+		page = NULL;
+		entry = RSN_HOLE;
+		if (xa_load(&rs->pages, idx)) {
+			page = alloc_page(gfp | __GFP_NOWARN | __GFP_HIGHMEM);
+			if (!page)
+				return -ENOMEM;
+			dst = kmap_local_page(page);
+			ram_store_read(rs, (sector_t)idx << RS_PAGE_SECTORS_SHIFT, dst, PAGE_SIZE);
+			kunmap_local(dst);
+			entry = page;
+		}
+		/*
+		 * Nothing overwrites the original before a copy is in, so a racing
+		 * writer of the same page made the same copy: keep the first.
+		 */
+		ret = xa_insert(&newest->pages, idx, entry, gfp);
+		if (ret) {
+			if (page)
+				__free_page(page);
+			if (ret == -EBUSY)
+				continue;
+			return ret;
+		}
+		if (page)
+			atomic_long_inc(&newest->nr_pages);
+	}
+	/* The copies are visible before the caller overwrites the originals, see ram_snap_read() */
+	smp_mb();
+	return 0;
+}
+
+/* First copy of idx from s onwards (newer), NULL: the origin still has it */
+static void *rsn_lookup(struct ram_snap *s, struct list_head *head, pgoff_t idx)
+{
+	void *entry;
+
+	list_for_each_entry_from_rcu(s, head, node) {
+		entry = xa_load(&s->pages, idx);
+		if (entry)
+			return entry;
+	}
+	return NULL;
+}
+
+void ram_snap_read(struct ram_snap *s, struct list_head *head, struct ram_store *rs, sector_t sector,
+		void *dst, size_t n)
+{
+	while (n) {
+		pgoff_t idx = sector >> RS_PAGE_SECTORS_SHIFT;
+		unsigned int offset = (sector & (RS_PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		size_t len = min_t(size_t, n, PAGE_SIZE - offset);
+		void *entry, *src;
+
+		rcu_read_lock();
+		entry = rsn_lookup(s, head, idx);
+		if (!entry) {
+			ram_store_read(rs, sector, dst, len);
+			/*
+			 * A writer may have preserved the page and changed it while
+			 * we copied: then the copy is torn and the snapshot has it.
+			 */
+			smp_rmb();
+			entry = rsn_lookup(s, head, idx);
+		}
+		if (entry == RSN_HOLE) {
+			memset(dst, 0, len);
+		} else if (entry) {
+			src = kmap_local_page(entry);
+			memcpy(dst, src + offset, len);
+			kunmap_local(src);
+		}
+		rcu_read_unlock();
+
+		dst += len;
+		n -= len;
+		sector += len >> SECTOR_SHIFT;
+	}
+}
+
+void ram_snap_unlink(struct ram_snap *s, struct list_head *head, gfp_t gfp)
+{
+	struct ram_snap *older = list_is_first(&s->node, head) ? NULL : list_prev_entry(s, node);
+	unsigned long idx;
+	void *entry;
+
+	xa_for_each(&s->pages, idx, entry) {
+		if (!older || xa_load(&older->pages, idx))
+			continue;
+		xa_store(&older->pages, idx, entry, gfp);
+		if (!xa_is_value(entry))
+			atomic_long_inc(&older->nr_pages);
+	}
+	s->heir = older;
+	list_del_rcu(&s->node);
+}
@@ -0,0 +1,63 @@
+/*
+ * Copy-on-write point in time snapshots of a RAM store
+ *
+ * Creating a snapshot only links an empty xarray into the origin's list
+ * (oldest first). The first write (or discard) of a page afterwards
+ * preserves the page as it was into the newest snapshot, so a snapshot
+ * costs memory in proportion to what changed since, not to the disk.
+ *
+ * A snapshot reads a page from the first of itself and the newer
+ * snapshots that holds it, else from the origin: a snapshot with no copy
+ * of a page saw it unchanged until the next snapshot was taken. Holes
+ * that got written are preserved as a value entry and read as zeroes.
+ *
+ * The list and the newest snapshot only change while no origin write is
+ * in flight (the driver freezes the origin queue); readers walk the list
+ * under RCU. Compressed stores aren't supported.
+ */
+#ifndef _RAM_SNAP_H_
+#define _RAM_SNAP_H_
+
+#include <linux/list.h>
+#include <linux/xarray.h>
+#include <linux/atomic.h>
+
+#include "ram_store.h"
+
+struct gendisk;
+
+struct ram_snap {
+	struct list_head node;			/* Origin's snapshots, oldest first */
+	struct xarray pages;			/* Page index -> preserved page or hole */
+	atomic_long_t nr_pages;			/* Preserved pages (holes take none) */
+	struct ram_snap *heir;			/* Older snapshot that took over the pages, see ram_snap_unlink() */
+	unsigned int id;
+	struct gendisk *gd;			/* Read only disk, owned by the driver */
+	void *private;
+};
+
+struct ram_snap *ram_snap_alloc(void);
+/* After unlinking and an RCU grace period: frees what the heir didn't take */
+void ram_snap_free(struct ram_snap *s);
+
+/*
+ * Preserve the pages holding n bytes at sector into newest before the
+ * origin changes them. -ENOMEM when a copy can't be allocated with gfp.
+ */
+int ram_snap_preserve(struct ram_snap *newest, struct ram_store *rs, sector_t sector, size_t n, gfp_t gfp);
+/* Read n bytes at sector as they were when s was taken */
+void ram_snap_read(struct ram_snap *s, struct list_head *head, struct ram_store *rs, sector_t sector,
+		void *dst, size_t n);
+/*
+ * Take s out of head. The next older snapshot relied on s for the pages
+ * it has no copy of and inherits them, which can't be undone: gfp must
+ * include __GFP_NOFAIL.
+ */
+void ram_snap_unlink(struct ram_snap *s, struct list_head *head, gfp_t gfp);
+
+static inline unsigned long ram_snap_pages(struct ram_snap *s)
+{
+	return atomic_long_read(&s->nr_pages);
+}
+
+#endif
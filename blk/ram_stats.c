@@ -0,0 +1,164 @@
+/*
+ * I/O statistics for the RAM block drivers: debugfs side
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+
+#include "ram_stats.h"
+
+static const char * const rs_dir_name[RS_DIR_NR] = {
+	[RS_DIR_READ]    = "read",
+	[RS_DIR_WRITE]   = "write",
+	[RS_DIR_DISCARD] = "discard",
+	[RS_DIR_FLUSH]   = "flush",
+};
+
+/* Fold every CPU into one snapshot */
+static void rs_sum(struct ram_stats *st, struct ram_stats_cpu *sum)
+{
+	int cpu, d, b;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		struct ram_stats_cpu *c = per_cpu_ptr(st->cpu, cpu);
+
+		for (d = 0; d < RS_DIR_NR; d++) {
+			sum->ops[d] += c->ops[d];
+			sum->bytes[d] += c->bytes[d];
+			sum->merges[d] += c->merges[d];
+			sum->errors[d] += c->errors[d];
+			for (b = 0; b < RS_LAT_BUCKETS; b++)
+				sum->lat[d][b] += c->lat[d][b];
+		}
+	}
+}
+
+static void rs_reset(struct ram_stats *st)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(st->cpu, cpu), 0, sizeof(struct ram_stats_cpu));
+}
+
+/* Upper bound (ns) of the bucket holding the permille'th I/O */
+static u64 rs_percentile(const u64 *lat, u64 total, unsigned int permille)
+{
+	u64 want = div_u64(total * permille + 999, 1000), seen = 0;
+	int b;
+
+	for (b = 0; b < RS_LAT_BUCKETS; b++) {
+		seen += lat[b];
+		if (seen >= want)
+			return 1ULL << (b + 1);
+	}
+	return 1ULL << RS_LAT_BUCKETS;
+}
+
+static int rs_stats_show(struct seq_file *m, void *v)
+{
+	struct ram_stats_cpu *sum;
+	int d;
+
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+	rs_sum(m->private, sum);
+	seq_printf(m, "%-8s %14s %18s %14s %10s\n", "dir", "ops", "bytes", "merges", "errors");
+	for (d = 0; d < RS_DIR_NR; d++)
+		seq_printf(m, "%-8s %14llu %18llu %14llu %10llu\n", rs_dir_name[d],
+			sum->ops[d], sum->bytes[d], sum->merges[d], sum->errors[d]);
+	kfree(sum);
+	return 0;
+}
+
+static int rs_latency_show(struct seq_file *m, void *v)
+{
+	struct ram_stats_cpu *sum;
+	int d, b;
+
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+	rs_sum(m->private, sum);
+	for (d = 0; d < RS_DIR_NR; d++) {
+		u64 total = sum->ops[d];
+
+		seq_printf(m, "%s: %llu ops", rs_dir_name[d], total);
+		if (total)
+			seq_printf(m, "  p50 < %lluns  p90 < %lluns  p99 < %lluns  p99.9 < %lluns",
+				rs_percentile(sum->lat[d], total, 500),
+				rs_percentile(sum->lat[d], total, 900),
+				rs_percentile(sum->lat[d], total, 990),
+				rs_percentile(sum->lat[d], total, 999));
+		seq_putc(m, '\n');
+		for (b = 0; b < RS_LAT_BUCKETS; b++) {
+			if (!sum->lat[d][b])
+				continue;
+			seq_printf(m, "  [%12llu, %12llu) ns: %llu\n",
+				b ? 1ULL << b : 0ULL, 1ULL << (b + 1), sum->lat[d][b]);
+		}
+	}
+	kfree(sum);
+	return 0;
+}
+
+static ssize_t rs_reset_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+
+	rs_reset(m->private);
+	return count;
+}
+
+static int rs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rs_stats_show, inode->i_private);
+}
+
+static int rs_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rs_latency_show, inode->i_private);
+}
+
+static const struct file_operations rs_stats_fops = {
+	.owner   = THIS_MODULE,
+	.open    = rs_stats_open,
+	.read    = seq_read,
+	.write   = rs_reset_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations rs_latency_fops = {
+	.owner   = THIS_MODULE,
+	.open    = rs_latency_open,
+	.read    = seq_read,
+	.write   = rs_reset_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+int ram_stats_init(struct ram_stats *st, const char *name, struct dentry *parent)
+{
+	st->cpu = alloc_percpu(struct ram_stats_cpu);
+	if (!st->cpu)
+		return -ENOMEM;
+	/* debugfs is best effort: failures here must not stop the disk */
+	st->dir = debugfs_create_dir(name, parent);
+	debugfs_create_file("stats", 0600, st->dir, st, &rs_stats_fops);
+	debugfs_create_file("latency", 0600, st->dir, st, &rs_latency_fops);
+	return 0;
+}
+
+void ram_stats_exit(struct ram_stats *st)
+{
+	debugfs_remove_recursive(st->dir);
+	st->dir = NULL;
+	free_percpu(st->cpu);
+	st->cpu = NULL;
+}
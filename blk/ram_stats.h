@@ -0,0 +1,72 @@
+/*
+ * I/O statistics for the RAM block drivers
+ *
+ * Counters are per CPU and updated without locks or atomics, with local
+ * interrupts off: a delayed completion accounts from its hrtimer in
+ * hardirq context. Readers sum all CPUs. Service time is kept as a log2 histogram: bucket i counts
+ * I/Os that took [2^i, 2^(i+1)) ns from request start to completion.
+ * Everything is exported under debugfs:
+ *
+ *	/sys/kernel/debug/vd/<disk>/stats	ops, bytes, merges, errors
+ *	/sys/kernel/debug/vd/<disk>/latency	histogram + p50/p90/p99/p99.9
+ *
+ * Writing anything to either file resets the counters.
+ */
+#ifndef _RAM_STATS_H_
+#define _RAM_STATS_H_
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/irqflags.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+
+enum {
+	RS_DIR_READ,
+	RS_DIR_WRITE,
+	RS_DIR_DISCARD,		/* discard + write zeroes */
+	RS_DIR_FLUSH,
+	RS_DIR_NR,
+};
+
+#define RS_LAT_BUCKETS	36	/* 2^35 ns ~ 34 s, the last bucket is open ended */
+
+struct ram_stats_cpu {
+	u64 ops[RS_DIR_NR];
+	u64 bytes[RS_DIR_NR];
+	u64 merges[RS_DIR_NR];	/* bios folded into a request by the block layer */
+	u64 errors[RS_DIR_NR];
+	u64 lat[RS_DIR_NR][RS_LAT_BUCKETS];
+};
+
+struct ram_stats {
+	struct ram_stats_cpu __percpu *cpu;
+	struct dentry *dir;
+};
+
+int ram_stats_init(struct ram_stats *st, const char *name, struct dentry *parent);
+void ram_stats_exit(struct ram_stats *st);
+
+/* Account one completed I/O that started at start_ns (ktime_get_ns()) */
+static inline void ram_stats_account(struct ram_stats *st, int dir, unsigned int bytes,
+		unsigned int merges, u64 start_ns, int error)
+{
+	struct ram_stats_cpu *c;
+	u64 ns = ktime_get_ns() - start_ns;
+	int bucket = ns ? min_t(int, ilog2(ns), RS_LAT_BUCKETS - 1) : 0;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	c = this_cpu_ptr(st->cpu);
+	c->ops[dir]++;
+	c->bytes[dir] += bytes;
+	c->merges[dir] += merges;
+	if (error)
+		c->errors[dir]++;
+	c->lat[dir][bucket]++;
+	local_irq_restore(flags);
+}
+
+#endif
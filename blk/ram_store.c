@@ -0,0 +1,386 @@
+/*
+ * Sparse page backed storage for the RAM block drivers
+ *
+ * Pages are allocated lazily on first write (like drivers/block/brd.c)
+ * and may live in highmem, so every access goes through kmap_local_page().
+ *
+ * Discard can free a page while another CPU is still copying through it,
+ * so lookups + copies run under rcu_read_lock() and pages removed from
+ * the xarray are only returned to the allocator after a grace period.
+ */
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/gfp.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/nodemask.h>
+#include <linux/string.h>
+
+#include "ram_store.h"
+#include "ram_comp.h"
+#include "ram_dedup.h"
+
+/* ram_store.o is linked into every RAM disk module: the tracepoints live here */
+#define CREATE_TRACE_POINTS
+#include "ram_trace.h"
+
+int ram_store_init(struct ram_store *rs)
+{
+	xa_init(&rs->pages);
+	atomic_long_set(&rs->nr_pages, 0);
+	rs->numa_policy = RS_NUMA_LOCAL;
+	rs->numa_node = NUMA_NO_NODE;
+	rs->nr_nodes = 0;
+	rs->nodes = NULL;
+	rs->comp = NULL;
+	rs->dedup = NULL;
+	rs->node_pages = kcalloc(nr_node_ids, sizeof(*rs->node_pages), GFP_KERNEL);
+	return rs->node_pages ? 0 : -ENOMEM;
+}
+
+int ram_store_set_numa(struct ram_store *rs, int policy, int node)
+{
+	int nid;
+
+	switch (policy) {
+	case RS_NUMA_LOCAL:
+		break;
+	case RS_NUMA_BIND:
+		if (node < 0 || node >= nr_node_ids || !node_online(node))
+			return -EINVAL;
+		rs->numa_node = node;
+		break;
+	case RS_NUMA_INTERLEAVE:
+		rs->nodes = kcalloc(nr_node_ids, sizeof(*rs->nodes), GFP_KERNEL);
+		if (!rs->nodes)
+			return -ENOMEM;
+		for_each_online_node(nid)
+			rs->nodes[rs->nr_nodes++] = nid;
+		break;
+	default:
+		return -EINVAL;
+	}
+	rs->numa_policy = policy;
+	return 0;
+}
+
+int ram_store_set_compress(struct ram_store *rs, const char *alg, const char *name)
+{
+	return ram_comp_init(rs, alg, name);
+}
+
+int ram_store_set_dedup(struct ram_store *rs, unsigned long nr_pages)
+{
+	if (rs->comp)                                           /* Pages must hold the data as is */
+		return -EINVAL;
+	return ram_dedup_init(rs, nr_pages);
+}
+
+/* Page placement per numa_policy, see ram_store.h */
+static struct page *rs_alloc_page(struct ram_store *rs, pgoff_t idx, gfp_t gfp)
+{
+	switch (rs->numa_policy) {
+	case RS_NUMA_INTERLEAVE:
+		return alloc_pages_node(rs->nodes[idx % rs->nr_nodes], gfp, 0);
+	case RS_NUMA_BIND:
+		return alloc_pages_node(rs->numa_node, gfp, 0);
+	default:
+		return alloc_page(gfp);
+	}
+}
+
+static void rs_account_add(struct ram_store *rs, struct page *page)
+{
+	atomic_long_inc(&rs->nr_pages);
+	atomic_long_inc(&rs->node_pages[page_to_nid(page)]);
+}
+
+static void rs_account_del(struct ram_store *rs, struct page *page)
+{
+	atomic_long_dec(&rs->nr_pages);
+	atomic_long_dec(&rs->node_pages[page_to_nid(page)]);
+}
+
+static void rs_free_page_rcu(struct rcu_head *head)
+{
+	__free_page(container_of(head, struct page, rcu_head));
+}
+
+void ram_store_free(struct ram_store *rs)
+{
+	struct page *page;
+	unsigned long idx;
+
+	ram_comp_free(rs);                                      /* Leaves the xarray empty */
+	ram_dedup_free(rs);                                     /* So does this */
+	rcu_barrier();                                          /* Let pending discards finish freeing */
+	xa_for_each(&rs->pages, idx, page) {
+		__free_page(page);
+		cond_resched();
+	}
+	xa_destroy(&rs->pages);
+	atomic_long_set(&rs->nr_pages, 0);
+	kfree(rs->node_pages);
+	rs->node_pages = NULL;
+	kfree(rs->nodes);
+	rs->nodes = NULL;
+}
+
+/*
+ * Fill the hole at idx with a zeroed page. Two writers racing on the
+ * same hole both allocate, the loser frees its page. Returns false only
+ * if no memory could be had.
+ */
+static bool rs_insert_page(struct ram_store *rs, pgoff_t idx, gfp_t gfp)
+{
+	struct page *page, *cur;
+
+	page = rs_alloc_page(rs, idx, gfp | __GFP_ZERO | __GFP_HIGHMEM | __GFP_NOWARN);
+	if (!page)
+		return false;
+	cur = xa_cmpxchg(&rs->pages, idx, NULL, page, gfp);
+	if (unlikely(cur)) {
+		__free_page(page);
+		return !xa_is_err(cur);
+	}
+	rs_account_add(rs, page);
+	return true;
+}
+
+static int rs_write(struct ram_store *rs, sector_t sector, const void *src, size_t n, gfp_t gfp, bool nt)
+{
+	while (n) {
+		pgoff_t idx = sector >> RS_PAGE_SECTORS_SHIFT;
+		unsigned int offset = (sector & (RS_PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		size_t len = min_t(size_t, n, PAGE_SIZE - offset);
+		struct page *page;
+		void *dst;
+
+		rcu_read_lock();
+		page = xa_load(&rs->pages, idx);
+		if (!page) {
+			rcu_read_unlock();
+			if (!rs_insert_page(rs, idx, gfp))
+				return -ENOMEM;
+			continue;                               /* Look it up again under RCU */
+		}
+		dst = kmap_local_page(page);
+		if (nt)
+			memcpy_flushcache(dst + offset, src, len);
+		else
+			memcpy(dst + offset, src, len);
+		kunmap_local(dst);
+		rcu_read_unlock();
+
+		src += len;
+		n -= len;
+		sector += len >> SECTOR_SHIFT;
+	}
+	return 0;
+}
+
+int ram_store_write(struct ram_store *rs, sector_t sector, const void *src, size_t n, gfp_t gfp)
+{
+	if (rs->comp)
+		return ram_comp_write(rs, sector, src, n, gfp);
+	if (rs->dedup)
+		return ram_dedup_write(rs, sector, src, n, gfp);
+	return rs_write(rs, sector, src, n, gfp, false);
+}
+
+int ram_store_write_nt(struct ram_store *rs, sector_t sector, const void *src, size_t n, gfp_t gfp)
+{
+	int ret;
+
+	if (rs->comp)
+		return ram_comp_write(rs, sector, src, n, gfp);
+	if (rs->dedup)                                          /* Hashing reads the data anyway */
+		return ram_dedup_write(rs, sector, src, n, gfp);
+	ret = rs_write(rs, sector, src, n, gfp, true);
+	/* Non-temporal stores are weakly ordered: drain them before the I/O can complete */
+	wmb();
+	return ret;
+}
+
+void ram_store_read(struct ram_store *rs, sector_t sector, void *dst, size_t n)
+{
+	if (rs->comp) {
+		ram_comp_read(rs, sector, dst, n);
+		return;
+	}
+	while (n) {
+		pgoff_t idx = sector >> RS_PAGE_SECTORS_SHIFT;
+		unsigned int offset = (sector & (RS_PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		size_t len = min_t(size_t, n, PAGE_SIZE - offset);
+		struct page *page;
+		void *src;
+
+		rcu_read_lock();
+		page = xa_load(&rs->pages, idx);
+		if (page) {
+			src = kmap_local_page(page);
+			memcpy(dst, src + offset, len);
+			kunmap_local(src);
+		} else {
+			memset(dst, 0, len);                    /* Never written: hole reads as zeroes */
+		}
+		rcu_read_unlock();
+
+		dst += len;
+		n -= len;
+		sector += len >> SECTOR_SHIFT;
+	}
+}
+
+/* Zero part of one page, if it is backed at all */
+static void rs_zero_partial(struct ram_store *rs, pgoff_t idx, unsigned int offset, size_t len)
+{
+	struct page *page;
+
+	if (rs->comp) {
+		ram_comp_zero(rs, idx, offset, len);
+		return;
+	}
+	if (rs->dedup) {
+		ram_dedup_zero(rs, idx, offset, len);
+		return;
+	}
+	rcu_read_lock();
+	page = xa_load(&rs->pages, idx);
+	if (page)
+		memzero_page(page, offset, len);
+	rcu_read_unlock();
+}
+
+/*
+ * Discard / write zeroes: every page fully inside the range is taken out
+ * of the xarray and freed, so the range reads back as zeroes and its
+ * memory is returned. Only the partial pages at either end are memset.
+ * The cost is one xarray walk over the pages actually present.
+ */
+void ram_store_discard(struct ram_store *rs, sector_t sector, size_t n)
+{
+	pgoff_t first = sector >> RS_PAGE_SECTORS_SHIFT;
+	pgoff_t last = (sector + (n >> SECTOR_SHIFT) - 1) >> RS_PAGE_SECTORS_SHIFT;
+	unsigned int head = (sector & (RS_PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+	unsigned int tail = ((sector + (n >> SECTOR_SHIFT)) & (RS_PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+	struct page *page;
+	unsigned long idx;
+
+	if (!n)
+		return;
+	if (first == last && (head || tail)) {
+		rs_zero_partial(rs, first, head, n);
+		return;
+	}
+	if (head) {
+		rs_zero_partial(rs, first, head, PAGE_SIZE - head);
+		first++;
+	}
+	if (tail) {
+		rs_zero_partial(rs, last, 0, tail);
+		if (last == 0)
+			return;
+		last--;
+	}
+	if (first > last)
+		return;
+
+	xa_for_each_range(&rs->pages, idx, page, first, last) {
+		if (rs->comp) {                                 /* page is really an rc_entry */
+			ram_comp_zero(rs, idx, 0, PAGE_SIZE);
+			continue;
+		}
+		page = xa_erase(&rs->pages, idx);
+		if (!page)
+			continue;
+		if (rs->dedup) {                                /* Maybe shared with other indexes */
+			ram_dedup_release(rs, page);
+			continue;
+		}
+		rs_account_del(rs, page);
+		call_rcu(&page->rcu_head, rs_free_page_rcu);
+	}
+}
+
+/*
+ * Checking the marks and erasing happen under the xarray lock, so a page
+ * marked meanwhile stays. Freeing is deferred like discard's, and a
+ * caller holding its own reference keeps the page alive past that.
+ */
+bool ram_store_evict_page(struct ram_store *rs, pgoff_t idx, xa_mark_t keep, xa_mark_t busy)
+{
+	struct page *page = NULL;
+
+	if (WARN_ON_ONCE(rs->comp || rs->dedup))
+		return false;
+	xa_lock(&rs->pages);
+	if (!xa_get_mark(&rs->pages, idx, keep) && !xa_get_mark(&rs->pages, idx, busy))
+		page = __xa_erase(&rs->pages, idx);
+	xa_unlock(&rs->pages);
+	if (!page)
+		return false;
+	rs_account_del(rs, page);
+	call_rcu(&page->rcu_head, rs_free_page_rcu);
+	return true;
+}
+
+/* True when the nr_sects sectors at sector (inside one page) read as zeroes */
+static bool rs_sectors_zero(struct ram_store *rs, sector_t sector, sector_t nr_sects)
+{
+	u8 buf[SECTOR_SIZE];
+
+	for (; nr_sects; sector++, nr_sects--) {
+		ram_store_read(rs, sector, buf, SECTOR_SIZE);
+		if (memchr_inv(buf, 0, SECTOR_SIZE))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * True when nothing in [sector, sector + nr_sects) holds data: no backed
+ * page lies entirely inside, and the parts of the pages at either end
+ * that are inside read as zeroes.
+ */
+bool ram_store_range_empty(struct ram_store *rs, sector_t sector, sector_t nr_sects)
+{
+	sector_t end = sector + nr_sects;
+	sector_t head_end = min_t(sector_t, end, round_up(sector, RS_PAGE_SECTORS));
+	sector_t tail_start = max_t(sector_t, head_end, round_down(end, RS_PAGE_SECTORS));
+	unsigned long first = head_end >> RS_PAGE_SECTORS_SHIFT;
+	unsigned long last = tail_start >> RS_PAGE_SECTORS_SHIFT;
+
+	if (!rs_sectors_zero(rs, sector, head_end - sector) ||
+			!rs_sectors_zero(rs, tail_start, end - tail_start))
+		return false;
+	if (last <= first)
+		return true;
+	return !xa_find(&rs->pages, &first, last - 1, XA_PRESENT);
+}
+
+int ram_store_fill_page(struct ram_store *rs, pgoff_t idx, const void *src, gfp_t gfp)
+{
+	struct page *page, *cur;
+	void *dst;
+
+	if (WARN_ON_ONCE(rs->comp))
+		return -EINVAL;
+	if (rs->dedup)
+		return ram_dedup_fill(rs, idx, src, gfp);
+	page = rs_alloc_page(rs, idx, gfp | __GFP_HIGHMEM | __GFP_NOWARN);
+	if (!page)
+		return -ENOMEM;
+	dst = kmap_local_page(page);
+	memcpy(dst, src, PAGE_SIZE);
+	kunmap_local(dst);
+	/* Unlike rs_insert_page() the contents are complete before anyone can see the page */
+	cur = xa_cmpxchg(&rs->pages, idx, NULL, page, gfp);
+	if (unlikely(cur)) {
+		__free_page(page);
+		return xa_is_err(cur) ? xa_err(cur) : 0;
+	}
+	rs_account_add(rs, page);
+	return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Sparse page backed storage for the RAM block drivers
+ *
+ * The disk is kept as an xarray of pages indexed by page number
+ * (sector >> RS_PAGE_SECTORS_SHIFT). A page is only allocated the first
+ * time something is written into it; reads of a hole return zeroes.
+ * So a device only costs the memory that was actually written and each
+ * copy stays inside one page instead of walking a vmalloc mapping.
+ *
+ * The pages are ordinary (highmem) allocations, not ZONE_DEVICE memory,
+ * so the disks offer no DAX: fsdax wants devmap pages whose
+ * page->mapping it owns, and memremap_pages() needs a physical range
+ * that isn't System RAM already. brd dropped its DAX mode for the same
+ * reason.
+ */
+#ifndef _RAM_STORE_H_
+#define _RAM_STORE_H_
+
+#include <linux/types.h>
+#include <linux/xarray.h>
+#include <linux/blkdev.h>
+
+#define RS_PAGE_SECTORS_SHIFT	(PAGE_SHIFT - SECTOR_SHIFT)
+#define RS_PAGE_SECTORS		(1 << RS_PAGE_SECTORS_SHIFT)
+
+/*
+ * Where backing pages are allocated:
+ *  RS_NUMA_LOCAL	first touch, on the node of the CPU doing the first
+ *			write (i.e. the submitting CPU / its hardware queue)
+ *  RS_NUMA_INTERLEAVE	page index round robin over the online nodes, so
+ *			a large sequential stream uses every socket's memory
+ *  RS_NUMA_BIND	everything on one node (preferred, not strict)
+ */
+enum {
+	RS_NUMA_LOCAL,
+	RS_NUMA_INTERLEAVE,
+	RS_NUMA_BIND,
+};
+
+struct ram_store {
+	struct xarray pages;		/* page index -> struct page *   */
+	atomic_long_t nr_pages;		/* pages currently holding data   */
+	int numa_policy;		/* RS_NUMA_*                      */
+	int numa_node;			/* RS_NUMA_BIND target            */
+	int nr_nodes;			/* RS_NUMA_INTERLEAVE: nodes[]    */
+	int *nodes;
+	atomic_long_t *node_pages;	/* [nr_node_ids] pages per node   */
+	struct ram_comp *comp;		/* Compressed mode, see ram_comp.h */
+	struct ram_dedup *dedup;	/* Deduplicated mode, see ram_dedup.h */
+};
+
+int ram_store_init(struct ram_store *rs);
+void ram_store_free(struct ram_store *rs);
+int ram_store_set_numa(struct ram_store *rs, int policy, int node);
+/*
+ * Keep the data compressed with alg (lz4, lzo, ...); name labels the
+ * zsmalloc pool. Call before anything is written. The store then sleeps
+ * on every access and never allocates from NUMA policy.
+ */
+int ram_store_set_compress(struct ram_store *rs, const char *alg, const char *name);
+/*
+ * Store every distinct page once, nr_pages sizes the hash table. Call
+ * before anything is written; not with compression. Zeroing part of a
+ * shared page must unshare it, so discard may sleep then.
+ */
+int ram_store_set_dedup(struct ram_store *rs, unsigned long nr_pages);
+
+/*
+ * Copy n bytes to/from the store starting at sector. A write may need
+ * to allocate backing pages with gfp and returns -ENOMEM when it can't.
+ */
+int ram_store_write(struct ram_store *rs, sector_t sector, const void *src, size_t n, gfp_t gfp);
+void ram_store_read(struct ram_store *rs, sector_t sector, void *dst, size_t n);
+/*
+ * ram_store_write() with non-temporal stores: the data goes to memory
+ * without being pulled into the CPU caches, so a streaming write doesn't
+ * evict the working set. Compressed and deduplicated stores copy as usual.
+ */
+int ram_store_write_nt(struct ram_store *rs, sector_t sector, const void *src, size_t n, gfp_t gfp);
+/* Drop the backing of n bytes at sector: they read back as zeroes */
+void ram_store_discard(struct ram_store *rs, sector_t sector, size_t n);
+/*
+ * Drop the page at idx unless mark keep or busy is set on it, for a
+ * cache tier whose pages have a copy elsewhere (uncompressed stores
+ * only). Returns true when a page was dropped.
+ */
+bool ram_store_evict_page(struct ram_store *rs, pgoff_t idx, xa_mark_t keep, xa_mark_t busy);
+/* No data in the range: a shrink to sector loses nothing */
+bool ram_store_range_empty(struct ram_store *rs, sector_t sector, sector_t nr_sects);
+/*
+ * Fill the hole at idx with a copy of the page at src. Returns 0 without
+ * touching anything if idx got backed meanwhile (uncompressed stores).
+ */
+int ram_store_fill_page(struct ram_store *rs, pgoff_t idx, const void *src, gfp_t gfp);
+
+static inline unsigned long ram_store_pages(struct ram_store *rs)
+{
+	return atomic_long_read(&rs->nr_pages);
+}
+
+static inline unsigned long ram_store_node_pages(struct ram_store *rs, int nid)
+{
+	return atomic_long_read(&rs->node_pages[nid]);
+}
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ * Tracepoints for the RAM block drivers
+ *
+ * Each tracepoint sits behind its own static key: while disabled it is a
+ * patched out jump, its arguments are never evaluated and nothing is
+ * logged. Enable at runtime with e.g.
+ *
+ *	echo 1 > /sys/kernel/tracing/events/ramdisk/enable
+ *	cat /sys/kernel/tracing/trace_pipe
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ramdisk
+
+#if !defined(_RAM_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _RAM_TRACE_H_
+
+#include <linux/tracepoint.h>
+#include <linux/blkdev.h>
+
+#define show_ramdisk_op(op)					\
+	__print_symbolic(op,					\
+		{ REQ_OP_READ,		"READ" },		\
+		{ REQ_OP_WRITE,		"WRITE" },		\
+		{ REQ_OP_FLUSH,		"FLUSH" },		\
+		{ REQ_OP_DISCARD,	"DISCARD" },		\
+		{ REQ_OP_WRITE_ZEROES,	"WRITE_ZEROES" })
+
+DECLARE_EVENT_CLASS(ramdisk_io,
+
+	TP_PROTO(struct gendisk *disk, unsigned int op, sector_t sector, unsigned int bytes, int error),
+
+	TP_ARGS(disk, op, sector, bytes, error),
+
+	TP_STRUCT__entry(
+		__string(	disk,	disk->disk_name	)
+		__field(	unsigned int,	op	)
+		__field(	sector_t,	sector	)
+		__field(	unsigned int,	bytes	)
+		__field(	int,		error	)
+	),
+
+	TP_fast_assign(
+		__assign_str(disk, disk->disk_name);
+		__entry->op	= op;
+		__entry->sector	= sector;
+		__entry->bytes	= bytes;
+		__entry->error	= error;
+	),
+
+	TP_printk("%s %s sector=%llu bytes=%u error=%d", __get_str(disk),
+		show_ramdisk_op(__entry->op), (unsigned long long)__entry->sector,
+		__entry->bytes, __entry->error)
+);
+
+/* Request or bio accepted by the driver */
+DEFINE_EVENT(ramdisk_io, ramdisk_issue,
+	TP_PROTO(struct gendisk *disk, unsigned int op, sector_t sector, unsigned int bytes, int error),
+	TP_ARGS(disk, op, sector, bytes, error)
+);
+
+/* Request or bio ended, error is the errno handed to the block layer */
+DEFINE_EVENT(ramdisk_io, ramdisk_complete,
+	TP_PROTO(struct gendisk *disk, unsigned int op, sector_t sector, unsigned int bytes, int error),
+	TP_ARGS(disk, op, sector, bytes, error)
+);
+
+/* One bio_vec copied to or from the store */
+TRACE_EVENT(ramdisk_segment,
+
+	TP_PROTO(struct gendisk *disk, int write, sector_t sector, unsigned int len),
+
+	TP_ARGS(disk, write, sector, len),
+
+	TP_STRUCT__entry(
+		__string(	disk,	disk->disk_name	)
+		__field(	int,		write	)
+		__field(	sector_t,	sector	)
+		__field(	unsigned int,	len	)
+	),
+
+	TP_fast_assign(
+		__assign_str(disk, disk->disk_name);
+		__entry->write	= write;
+		__entry->sector	= sector;
+		__entry->len	= len;
+	),
+
+	TP_printk("%s %c sector=%llu len=%u", __get_str(disk), __entry->write ? 'W' : 'R',
+		(unsigned long long)__entry->sector, __entry->len)
+);
+
+#endif /* _RAM_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ram_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,477 @@
+/*
+ * Write-back cache tier for the RAM block drivers, see ram_wb.h
+ */
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+
+#include "ram_wb.h"
+
+#define RW_DIRTY	XA_MARK_0
+#define RW_REF		XA_MARK_1		/* Used since the clock hand last passed */
+#define RW_WRITEBACK	XA_MARK_2		/* In a destage bio not completed yet */
+
+/* A destage bio, allocated from ram_wb.bio_set */
+struct rw_bio {
+	struct list_head list;			/* rw_destage()'s bios of this pass */
+	pgoff_t first;				/* Page index of the first bvec */
+	struct bio bio;
+};
+
+struct ram_wb {
+	struct ram_store *rs;
+	struct block_device *bdev;
+	sector_t capacity;
+	struct ram_wb_config cfg;
+	unsigned long dirty_limit;		/* pages */
+	unsigned long background_limit;
+	unsigned long cache_limit;		/* pages */
+	struct rw_semaphore evict_lock;		/* Writers shared, eviction exclusive */
+	unsigned long hand;			/* Clock position, under evict_lock */
+	struct workqueue_struct *wq;
+	struct delayed_work dwork;
+	struct bio_set bio_set;			/* struct rw_bio */
+	struct mutex destage_lock;		/* One destage pass at a time */
+	wait_queue_head_t throttle_wq;		/* Writers above dirty_limit */
+	atomic_long_t nr_dirty;
+	atomic_t inflight;			/* Destage bios not completed yet */
+	wait_queue_head_t inflight_wq;
+	atomic_t error;				/* First destage error since the last flush */
+	atomic64_t read_hits, read_misses, fills;
+	atomic64_t destaged_pages, destage_ios;
+	atomic64_t throttled, errors, evicted;
+};
+
+#define RW_MODE		(FMODE_READ | FMODE_WRITE | FMODE_EXCL)
+
+/* Synchronous read from the backing device into len bytes of page at offset */
+static int rw_backing_read(struct ram_wb *wb, sector_t sector, struct page *page, unsigned int offset,
+		unsigned int len)
+{
+	struct bio_vec bvec;
+	struct bio bio;
+	int ret;
+
+	bio_init(&bio, &bvec, 1);
+	bio_set_dev(&bio, wb->bdev);
+	bio.bi_opf = REQ_OP_READ;
+	bio.bi_iter.bi_sector = sector;
+	bio_add_page(&bio, page, len, offset);
+	ret = submit_bio_wait(&bio);
+	bio_uninit(&bio);
+	return ret;
+}
+
+static void rw_set_dirty(struct ram_wb *wb, pgoff_t idx)
+{
+	struct xarray *xa = &wb->rs->pages;
+
+	xa_lock(xa);
+	if (!xa_get_mark(xa, idx, RW_DIRTY)) {
+		__xa_set_mark(xa, idx, RW_DIRTY);
+		atomic_long_inc(&wb->nr_dirty);
+	}
+	__xa_set_mark(xa, idx, RW_REF);
+	xa_unlock(xa);
+}
+
+/*
+ * May run in interrupt context, while the store's xa_lock isn't IRQ safe:
+ * the pages are released by rw_end_bio() once rw_destage() is back.
+ */
+static void rw_end_io(struct bio *bio)
+{
+	struct ram_wb *wb = bio->bi_private;
+
+	if (bio->bi_status) {
+		atomic_cmpxchg(&wb->error, 0, blk_status_to_errno(bio->bi_status));
+		atomic64_inc(&wb->errors);
+	}
+	if (atomic_dec_and_test(&wb->inflight))
+		wake_up(&wb->inflight_wq);
+}
+
+/*
+ * Take the pages of a completed bio out of writeback. Those that didn't
+ * make it to the backing device are marked dirty again: evicting them
+ * would lose the data, and the next pass retries them.
+ */
+static void rw_end_bio(struct ram_wb *wb, struct rw_bio *rb)
+{
+	struct xarray *xa = &wb->rs->pages;
+	pgoff_t idx = rb->first;
+	struct bvec_iter_all iter;
+	struct bio_vec *bv;
+
+	xa_lock(xa);
+	bio_for_each_segment_all(bv, &rb->bio, iter) {
+		__xa_clear_mark(xa, idx, RW_WRITEBACK);
+		if (rb->bio.bi_status && !xa_get_mark(xa, idx, RW_DIRTY)) {
+			__xa_set_mark(xa, idx, RW_DIRTY);
+			atomic_long_inc(&wb->nr_dirty);
+		}
+		put_page(bv->bv_page);
+		idx++;
+	}
+	xa_unlock(xa);
+	list_del(&rb->list);
+	bio_put(&rb->bio);
+}
+
+static void rw_submit(struct ram_wb *wb, struct bio *bio)
+{
+	atomic_inc(&wb->inflight);
+	atomic64_inc(&wb->destage_ios);
+	atomic64_add(bio->bi_vcnt, &wb->destaged_pages);
+	submit_bio(bio);
+	wake_up_all(&wb->throttle_wq);
+}
+
+/*
+ * Write every dirty page in [first, last] to the backing device, one bio
+ * per run of adjacent pages, and wait for all of them. Returns the
+ * number of pages written. RW_DIRTY moves to RW_WRITEBACK before the
+ * page goes into the bio: a write landing meanwhile marks it dirty again
+ * and the next pass writes it once more, and rw_evict() leaves the page
+ * alone until the bio has completed. A REQ_PREFLUSH in flags only goes
+ * on the first bio.
+ */
+static unsigned long rw_destage(struct ram_wb *wb, pgoff_t first, pgoff_t last, unsigned int flags)
+{
+	struct xarray *xa = &wb->rs->pages;
+	struct rw_bio *rb, *tmp;
+	struct bio *bio = NULL;
+	struct page *page;
+	unsigned long idx = first, next = 0, written = 0;
+	LIST_HEAD(bios);
+
+	mutex_lock(&wb->destage_lock);
+	for (page = xa_find(xa, &idx, last, RW_DIRTY); page; page = xa_find_after(xa, &idx, last, RW_DIRTY)) {
+		if (bio && (idx != next || bio->bi_vcnt == wb->cfg.batch_pages)) {
+			rw_submit(wb, bio);
+			bio = NULL;
+			cond_resched();
+		}
+		if (!bio) {
+			bio = bio_alloc_bioset(GFP_NOIO, wb->cfg.batch_pages, &wb->bio_set);
+			bio_set_dev(bio, wb->bdev);
+			bio->bi_opf = REQ_OP_WRITE | flags;
+			bio->bi_iter.bi_sector = (sector_t)idx << RS_PAGE_SECTORS_SHIFT;
+			bio->bi_end_io = rw_end_io;
+			bio->bi_private = wb;
+			rb = container_of(bio, struct rw_bio, bio);
+			rb->first = idx;
+			list_add_tail(&rb->list, &bios);
+			flags &= ~REQ_PREFLUSH;
+		}
+		get_page(page);
+		xa_lock(xa);
+		__xa_set_mark(xa, idx, RW_WRITEBACK);
+		__xa_clear_mark(xa, idx, RW_DIRTY);
+		xa_unlock(xa);
+		atomic_long_dec(&wb->nr_dirty);
+		bio_add_page(bio, page, PAGE_SIZE, 0);
+		next = idx + 1;
+		written++;
+	}
+	if (bio)
+		rw_submit(wb, bio);
+	wait_event(wb->inflight_wq, !atomic_read(&wb->inflight));
+	list_for_each_entry_safe(rb, tmp, &bios, list)
+		rw_end_bio(wb, rb);
+	mutex_unlock(&wb->destage_lock);
+	return written;
+}
+
+static void rw_flush_work(struct work_struct *work)
+{
+	struct ram_wb *wb = container_of(to_delayed_work(work), struct ram_wb, dwork);
+
+	rw_destage(wb, 0, ULONG_MAX, 0);
+	if (atomic_long_read(&wb->nr_dirty))                    /* Written meanwhile */
+		queue_delayed_work(wb->wq, &wb->dwork, msecs_to_jiffies(wb->cfg.interval_ms));
+}
+
+static void rw_throttle(struct ram_wb *wb)
+{
+	if (atomic_long_read(&wb->nr_dirty) < wb->dirty_limit)
+		return;
+	atomic64_inc(&wb->throttled);
+	mod_delayed_work(wb->wq, &wb->dwork, 0);
+	wait_event(wb->throttle_wq, atomic_long_read(&wb->nr_dirty) < wb->dirty_limit);
+}
+
+static void rw_kick(struct ram_wb *wb)
+{
+	if (atomic_long_read(&wb->nr_dirty) >= wb->background_limit)
+		mod_delayed_work(wb->wq, &wb->dwork, 0);
+	else                                                    /* No-op when already pending */
+		queue_delayed_work(wb->wq, &wb->dwork, msecs_to_jiffies(wb->cfg.interval_ms));
+}
+
+/*
+ * Clock over the cached pages, run by a writer when the store has grown
+ * past cache_limit: drop clean pages until it is a batch below. A page
+ * with RW_REF only loses the mark, so two sweeps are the most it takes;
+ * one still in writeback is passed over.
+ * Writers are held off meanwhile, none may copy into a page going away;
+ * reads look up and copy under RCU and don't care.
+ */
+static void rw_evict(struct ram_wb *wb)
+{
+	struct ram_store *rs = wb->rs;
+	unsigned long target = wb->cache_limit - min_t(unsigned long, wb->cache_limit, wb->cfg.batch_pages);
+	unsigned long idx, scan;
+	struct page *page;
+
+	down_write(&wb->evict_lock);
+	idx = wb->hand;
+	for (scan = 2 * ram_store_pages(rs); scan && ram_store_pages(rs) > target; scan--) {
+		if (ram_store_pages(rs) <= atomic_long_read(&wb->nr_dirty))
+			break;                                  /* Nothing clean left */
+		page = xa_find(&rs->pages, &idx, ULONG_MAX, XA_PRESENT);
+		if (!page) {                                    /* Wrap around */
+			idx = 0;
+			continue;
+		}
+		if (xa_get_mark(&rs->pages, idx, RW_REF))
+			xa_clear_mark(&rs->pages, idx, RW_REF);
+		else if (ram_store_evict_page(rs, idx, RW_DIRTY, RW_WRITEBACK))
+			atomic64_inc(&wb->evicted);
+		idx++;
+		cond_resched();
+	}
+	wb->hand = idx;
+	up_write(&wb->evict_lock);
+}
+
+/* Bring page idx in from the backing device before part of it is overwritten */
+static int rw_fill(struct ram_wb *wb, pgoff_t idx, gfp_t gfp)
+{
+	struct page *page;
+	int ret;
+
+	page = alloc_page(gfp);
+	if (!page)
+		return -ENOMEM;
+	ret = rw_backing_read(wb, (sector_t)idx << RS_PAGE_SECTORS_SHIFT, page, 0, PAGE_SIZE);
+	if (!ret)
+		ret = ram_store_fill_page(wb->rs, idx, page_address(page), gfp);
+	__free_page(page);
+	atomic64_inc(&wb->fills);
+	return ret;
+}
+
+int ram_wb_write(struct ram_wb *wb, sector_t sector, const void *src, size_t n, gfp_t gfp)
+{
+	int ret = 0;
+
+	rw_throttle(wb);
+	if (ram_store_pages(wb->rs) > wb->cache_limit)
+		rw_evict(wb);
+	down_read(&wb->evict_lock);
+	while (n) {
+		pgoff_t idx = sector >> RS_PAGE_SECTORS_SHIFT;
+		unsigned int offset = (sector & (RS_PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		size_t len = min_t(size_t, n, PAGE_SIZE - offset);
+
+		if (len != PAGE_SIZE && !xa_load(&wb->rs->pages, idx)) {
+			ret = rw_fill(wb, idx, gfp);
+			if (ret)
+				break;
+		}
+		ret = ram_store_write(wb->rs, sector, src, len, gfp);
+		if (ret)
+			break;
+		rw_set_dirty(wb, idx);                          /* Only after the data is in */
+		src += len;
+		n -= len;
+		sector += len >> SECTOR_SHIFT;
+	}
+	up_read(&wb->evict_lock);
+	if (!ret)
+		rw_kick(wb);
+	return ret;
+}
+
+/*
+ * dst is usually a kmap_local_page() address of a bio page, which
+ * virt_to_page() can't translate for a highmem page: a miss is read into
+ * a bounce page and copied from there. A hit is looked up and copied
+ * under RCU: a clean page evicted meanwhile still holds the same data.
+ */
+int ram_wb_read(struct ram_wb *wb, sector_t sector, void *dst, size_t n)
+{
+	struct xarray *xa = &wb->rs->pages;
+	struct page *bounce = NULL, *page;
+	int ret = 0;
+
+	while (n) {
+		pgoff_t idx = sector >> RS_PAGE_SECTORS_SHIFT;
+		unsigned int offset = (sector & (RS_PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		size_t len = min_t(size_t, n, PAGE_SIZE - offset);
+
+		rcu_read_lock();
+		page = xa_load(xa, idx);
+		if (page)
+			memcpy_from_page(dst, page, offset, len);
+		rcu_read_unlock();
+		if (page) {
+			if (!xa_get_mark(xa, idx, RW_REF))
+				xa_set_mark(xa, idx, RW_REF);
+			atomic64_inc(&wb->read_hits);
+		} else {
+			if (!bounce)
+				bounce = alloc_page(GFP_NOIO);
+			if (!bounce) {
+				ret = -ENOMEM;
+				break;
+			}
+			ret = rw_backing_read(wb, sector, bounce, offset, len);
+			if (ret)
+				break;
+			memcpy_from_page(dst, bounce, offset, len);
+			atomic64_inc(&wb->read_misses);
+		}
+		dst += len;
+		n -= len;
+		sector += len >> SECTOR_SHIFT;
+	}
+	if (bounce)
+		__free_page(bounce);
+	return ret;
+}
+
+int ram_wb_flush(struct ram_wb *wb)
+{
+	int ret;
+
+	rw_destage(wb, 0, ULONG_MAX, 0);
+	ret = atomic_xchg(&wb->error, 0);
+	if (!ret)
+		ret = blkdev_issue_flush(wb->bdev);
+	return ret;
+}
+
+/*
+ * A background pass may have written pages of the range without FUA
+ * already, they can still sit in the device's volatile cache: the first
+ * bio carries a preflush, and with nothing left to write a flush of its
+ * own does the job.
+ */
+int ram_wb_sync(struct ram_wb *wb, sector_t sector, size_t n)
+{
+	unsigned long written;
+	int ret;
+
+	if (!n)
+		return 0;
+	written = rw_destage(wb, sector >> RS_PAGE_SECTORS_SHIFT,
+		(sector + (n >> SECTOR_SHIFT) - 1) >> RS_PAGE_SECTORS_SHIFT, REQ_PREFLUSH | REQ_FUA);
+	ret = atomic_xchg(&wb->error, 0);
+	if (!ret && !written)
+		ret = blkdev_issue_flush(wb->bdev);
+	return ret;
+}
+
+sector_t ram_wb_capacity(struct ram_wb *wb)
+{
+	return wb->capacity;
+}
+
+void ram_wb_get_stats(struct ram_wb *wb, struct ram_wb_stats *st)
+{
+	st->dirty_pages = atomic_long_read(&wb->nr_dirty);
+	st->read_hits = atomic64_read(&wb->read_hits);
+	st->read_misses = atomic64_read(&wb->read_misses);
+	st->fills = atomic64_read(&wb->fills);
+	st->destaged_pages = atomic64_read(&wb->destaged_pages);
+	st->destage_ios = atomic64_read(&wb->destage_ios);
+	st->throttled = atomic64_read(&wb->throttled);
+	st->errors = atomic64_read(&wb->errors);
+	st->evicted = atomic64_read(&wb->evicted);
+}
+
+struct ram_wb *ram_wb_create(struct ram_store *rs, const char *path, const char *name,
+		const struct ram_wb_config *cfg)
+{
+	struct ram_wb *wb;
+	int ret;
+
+	if (rs->comp || rs->dedup)
+		return ERR_PTR(-EINVAL);
+	wb = kzalloc(sizeof(*wb), GFP_KERNEL);
+	if (!wb)
+		return ERR_PTR(-ENOMEM);
+	wb->rs = rs;
+	wb->bdev = blkdev_get_by_path(path, RW_MODE, wb);
+	if (IS_ERR(wb->bdev)) {
+		ret = PTR_ERR(wb->bdev);
+		pr_err("%s: can't open %s (%d)\n", __func__, path, ret);
+		goto free_wb;
+	}
+	/* Misses are read in 512 byte units */
+	if (bdev_logical_block_size(wb->bdev) != SECTOR_SIZE) {
+		pr_err("%s: %s must have 512 byte logical blocks\n", __func__, path);
+		ret = -EINVAL;
+		goto put_bdev;
+	}
+	wb->capacity = round_down(i_size_read(wb->bdev->bd_inode) >> SECTOR_SHIFT, RS_PAGE_SECTORS);
+	if (!wb->capacity) {
+		ret = -EINVAL;
+		goto put_bdev;
+	}
+
+	wb->cfg = *cfg;
+	wb->cfg.batch_pages = clamp_t(unsigned int, wb->cfg.batch_pages, 1, BIO_MAX_VECS);
+	wb->cfg.dirty_ratio = clamp_t(unsigned int, wb->cfg.dirty_ratio, 1, 100);
+	wb->cfg.background_ratio = min(wb->cfg.background_ratio, wb->cfg.dirty_ratio);
+	wb->dirty_limit = max(totalram_pages() / 100 * wb->cfg.dirty_ratio, 1UL);
+	wb->background_limit = totalram_pages() / 100 * wb->cfg.background_ratio;
+	/* Eviction needs clean pages to pick from: stay above the dirty limit */
+	wb->cfg.cache_ratio = clamp_t(unsigned int, wb->cfg.cache_ratio, wb->cfg.dirty_ratio, 100);
+	wb->cache_limit = max(totalram_pages() / 100 * wb->cfg.cache_ratio, wb->dirty_limit + wb->cfg.batch_pages);
+
+	ret = bioset_init(&wb->bio_set, BIO_POOL_SIZE, offsetof(struct rw_bio, bio), BIOSET_NEED_BVECS);
+	if (ret)
+		goto put_bdev;
+	wb->wq = alloc_workqueue("%s_wb", WQ_MEM_RECLAIM | WQ_UNBOUND, 1, name);
+	if (!wb->wq) {
+		ret = -ENOMEM;
+		goto exit_bioset;
+	}
+	INIT_DELAYED_WORK(&wb->dwork, rw_flush_work);
+	mutex_init(&wb->destage_lock);
+	init_rwsem(&wb->evict_lock);
+	init_waitqueue_head(&wb->throttle_wq);
+	init_waitqueue_head(&wb->inflight_wq);
+	pr_info("%s: %s caches %s (%llu sectors), dirty limit %lu pages, cache limit %lu pages\n", __func__,
+		name, path, (unsigned long long)wb->capacity, wb->dirty_limit, wb->cache_limit);
+	return wb;
+
+exit_bioset:
+	bioset_exit(&wb->bio_set);
+put_bdev:
+	blkdev_put(wb->bdev, RW_MODE);
+free_wb:
+	kfree(wb);
+	return ERR_PTR(ret);
+}
+
+void ram_wb_destroy(struct ram_wb *wb)
+{
+	cancel_delayed_work_sync(&wb->dwork);
+	if (ram_wb_flush(wb))
+		pr_err("%s: destage to the backing device failed, its contents are stale\n", __func__);
+	destroy_workqueue(wb->wq);
+	bioset_exit(&wb->bio_set);
+	blkdev_put(wb->bdev, RW_MODE);
+	kfree(wb);
+}
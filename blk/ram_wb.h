@@ -0,0 +1,66 @@
+/*
+ * Write-back cache tier: the RAM store in front of a slower block device
+ *
+ * A write is copied into the store, its pages get the RW_DIRTY mark in
+ * the store's xarray and the write completes at memory speed. A flusher
+ * (one unbound work per disk) walks the dirty marks in index order and
+ * destages each run of adjacent pages as a single write bio of up to
+ * batch_pages, so the backing device sees large sequential I/O. Reads
+ * are served from the store when the page is cached and go to the
+ * backing device otherwise; a partial write to a page that isn't cached
+ * reads that page in first.
+ *
+ * The RAM tier holds up to cache_ratio percent of RAM. Past that a
+ * writer drops clean pages in clock order first: the hand sweeps the
+ * page index, and a page read or written since it last passed is kept
+ * for one more round. Dirty pages stay until their destage bio has
+ * completed. Discard is not offered in this mode.
+ *
+ * Writers wait once dirty pages pass dirty_ratio percent of RAM, the
+ * flusher starts early above background_ratio and otherwise runs every
+ * interval_ms while anything is dirty. REQ_PREFLUSH destages everything
+ * and flushes the backing device, REQ_FUA writes the request's own pages
+ * through with FUA. A failed destage is reported by the next flush and
+ * leaves its pages dirty for the next pass.
+ */
+#ifndef _RAM_WB_H_
+#define _RAM_WB_H_
+
+#include "ram_store.h"
+
+struct ram_wb;
+
+struct ram_wb_config {
+	unsigned int dirty_ratio;	/* % of RAM: writers wait above this */
+	unsigned int background_ratio;	/* % of RAM: flusher starts above this */
+	unsigned int interval_ms;	/* flusher period while anything is dirty */
+	unsigned int batch_pages;	/* largest destage bio */
+	unsigned int cache_ratio;	/* % of RAM: clean pages are dropped above this */
+};
+
+struct ram_wb_stats {
+	u64 dirty_pages;
+	u64 read_hits, read_misses;
+	u64 fills;			/* partial writes that read the page in */
+	u64 destaged_pages, destage_ios;
+	u64 throttled;			/* writes that waited for the flusher */
+	u64 errors;			/* failed destage bios */
+	u64 evicted;			/* clean pages dropped for room */
+};
+
+/* Open path exclusively and cache it in rs, which must be empty and uncompressed */
+struct ram_wb *ram_wb_create(struct ram_store *rs, const char *path, const char *name,
+		const struct ram_wb_config *cfg);
+/* Destage what is left and release the backing device */
+void ram_wb_destroy(struct ram_wb *wb);
+/* Usable size of the backing device, whole pages */
+sector_t ram_wb_capacity(struct ram_wb *wb);
+
+/* Same contract as ram_store_write()/read(), a read may fail with the backing device */
+int ram_wb_write(struct ram_wb *wb, sector_t sector, const void *src, size_t n, gfp_t gfp);
+int ram_wb_read(struct ram_wb *wb, sector_t sector, void *dst, size_t n);
+int ram_wb_flush(struct ram_wb *wb);
+int ram_wb_sync(struct ram_wb *wb, sector_t sector, size_t n);
+void ram_wb_get_stats(struct ram_wb *wb, struct ram_wb_stats *st);
+
+#endif
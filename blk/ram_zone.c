@@ -0,0 +1,311 @@
+/*
+ * Host managed zoned emulation for the RAM block drivers, see ram_zone.h
+ */
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/log2.h>
+
+#include "ram_zone.h"
+
+struct rz_zone {
+	spinlock_t wlock;			/* Writer / reset / finish of this zone */
+	sector_t start;
+	sector_t wp;
+	unsigned int cond;			/* BLK_ZONE_COND_*, under ram_zoned.lock */
+	bool conv;
+	bool busy;				/* Write in flight, under ram_zoned.lock */
+};
+
+struct ram_zoned {
+	struct rz_zone *zones;
+	unsigned int nr_zones;
+	unsigned int zone_shift;		/* log2(zone_sectors) */
+	sector_t zone_sectors;
+	unsigned int max_open;			/* 0: no limit */
+	unsigned int max_active;
+	spinlock_t lock;			/* Conditions and the counters below */
+	unsigned int nr_imp_open;
+	unsigned int nr_exp_open;
+	unsigned int nr_closed;
+};
+
+static struct rz_zone *rz_zone(struct ram_zoned *z, sector_t sector)
+{
+	sector_t idx = sector >> z->zone_shift;
+
+	return idx < z->nr_zones ? &z->zones[idx] : NULL;
+}
+
+static sector_t rz_end(struct ram_zoned *z, struct rz_zone *zone)
+{
+	return zone->start + z->zone_sectors;
+}
+
+/* Move zone to cond and keep the open/closed counters in step */
+static void rz_set_cond(struct ram_zoned *z, struct rz_zone *zone, unsigned int cond)
+{
+	switch (zone->cond) {
+	case BLK_ZONE_COND_IMP_OPEN:
+		z->nr_imp_open--;
+		break;
+	case BLK_ZONE_COND_EXP_OPEN:
+		z->nr_exp_open--;
+		break;
+	case BLK_ZONE_COND_CLOSED:
+		z->nr_closed--;
+		break;
+	}
+	switch (cond) {
+	case BLK_ZONE_COND_IMP_OPEN:
+		z->nr_imp_open++;
+		break;
+	case BLK_ZONE_COND_EXP_OPEN:
+		z->nr_exp_open++;
+		break;
+	case BLK_ZONE_COND_CLOSED:
+		z->nr_closed++;
+		break;
+	}
+	zone->cond = cond;
+}
+
+/* An open or closed zone counts as active */
+static bool rz_can_activate(struct ram_zoned *z)
+{
+	return !z->max_active || z->nr_imp_open + z->nr_exp_open + z->nr_closed < z->max_active;
+}
+
+/*
+ * Room for one more open zone. At the limit an implicitly open zone is
+ * closed to make room, as a drive would; explicitly open ones stay, and
+ * so does a zone in the middle of a write (its wp is about to move).
+ */
+static bool rz_can_open(struct ram_zoned *z)
+{
+	unsigned int i;
+
+	if (!z->max_open || z->nr_imp_open + z->nr_exp_open < z->max_open)
+		return true;
+	for (i = 0; i < z->nr_zones; i++) {
+		struct rz_zone *zone = &z->zones[i];
+
+		if (zone->cond == BLK_ZONE_COND_IMP_OPEN && !zone->busy) {
+			rz_set_cond(z, zone, zone->wp == zone->start ? BLK_ZONE_COND_EMPTY : BLK_ZONE_COND_CLOSED);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Resources to take zone from EMPTY or CLOSED to an open condition */
+static blk_status_t rz_open(struct ram_zoned *z, struct rz_zone *zone, unsigned int cond)
+{
+	if (zone->cond == BLK_ZONE_COND_EMPTY && !rz_can_activate(z))
+		return BLK_STS_ZONE_ACTIVE_RESOURCE;
+	if (!rz_can_open(z))
+		return BLK_STS_ZONE_OPEN_RESOURCE;
+	rz_set_cond(z, zone, cond);
+	return BLK_STS_OK;
+}
+
+blk_status_t ram_zone_write_begin(struct ram_zoned *z, bool append, sector_t *sector, unsigned int nr)
+{
+	struct rz_zone *zone = rz_zone(z, *sector);
+	blk_status_t sts = BLK_STS_OK;
+
+	if (!zone)
+		return BLK_STS_IOERR;
+	spin_lock(&zone->wlock);
+	if (zone->conv) {
+		if (append)                                     /* Appends need a write pointer */
+			sts = BLK_STS_IOERR;
+		else if (*sector + nr > rz_end(z, zone))
+			sts = BLK_STS_IOERR;
+		goto out;
+	}
+	spin_lock(&z->lock);
+	if (append)
+		*sector = zone->wp;
+	if (zone->cond == BLK_ZONE_COND_FULL || *sector != zone->wp || *sector + nr > rz_end(z, zone))
+		sts = BLK_STS_IOERR;
+	else if (zone->cond == BLK_ZONE_COND_EMPTY || zone->cond == BLK_ZONE_COND_CLOSED)
+		sts = rz_open(z, zone, BLK_ZONE_COND_IMP_OPEN);
+	if (!sts)
+		zone->busy = true;
+	spin_unlock(&z->lock);
+out:
+	if (sts)
+		spin_unlock(&zone->wlock);
+	return sts;
+}
+
+void ram_zone_write_end(struct ram_zoned *z, sector_t sector, unsigned int nr, int error)
+{
+	struct rz_zone *zone = rz_zone(z, sector);
+
+	if (!zone->conv) {
+		spin_lock(&z->lock);
+		zone->busy = false;
+		if (!error) {
+			zone->wp += nr;
+			if (zone->wp == rz_end(z, zone))
+				rz_set_cond(z, zone, BLK_ZONE_COND_FULL);
+		}
+		spin_unlock(&z->lock);
+	}
+	spin_unlock(&zone->wlock);
+}
+
+static void rz_reset(struct ram_zoned *z, struct ram_store *rs, struct rz_zone *zone)
+{
+	spin_lock(&z->lock);
+	rz_set_cond(z, zone, BLK_ZONE_COND_EMPTY);
+	zone->wp = zone->start;
+	spin_unlock(&z->lock);
+	/* Reads of the zone return zeroes again and its memory is freed */
+	ram_store_discard(rs, zone->start, (size_t)z->zone_sectors << SECTOR_SHIFT);
+}
+
+blk_status_t ram_zone_mgmt(struct ram_zoned *z, struct ram_store *rs, unsigned int op, sector_t sector)
+{
+	struct rz_zone *zone;
+	blk_status_t sts = BLK_STS_OK;
+	unsigned int i;
+
+	if (op == REQ_OP_ZONE_RESET_ALL) {
+		for (i = 0; i < z->nr_zones; i++) {
+			zone = &z->zones[i];
+			if (zone->conv)
+				continue;
+			spin_lock(&zone->wlock);
+			if (zone->cond != BLK_ZONE_COND_EMPTY)
+				rz_reset(z, rs, zone);
+			spin_unlock(&zone->wlock);
+		}
+		return BLK_STS_OK;
+	}
+
+	zone = rz_zone(z, sector);
+	if (!zone || zone->conv)
+		return BLK_STS_IOERR;
+	spin_lock(&zone->wlock);
+	if (op == REQ_OP_ZONE_RESET) {
+		rz_reset(z, rs, zone);
+		goto out;
+	}
+	spin_lock(&z->lock);
+	switch (op) {
+	case REQ_OP_ZONE_OPEN:
+		if (zone->cond == BLK_ZONE_COND_IMP_OPEN)
+			rz_set_cond(z, zone, BLK_ZONE_COND_EXP_OPEN);
+		else if (zone->cond == BLK_ZONE_COND_EMPTY || zone->cond == BLK_ZONE_COND_CLOSED)
+			sts = rz_open(z, zone, BLK_ZONE_COND_EXP_OPEN);
+		break;                                          /* Already open or full: nothing to do */
+	case REQ_OP_ZONE_CLOSE:
+		if (zone->cond == BLK_ZONE_COND_IMP_OPEN || zone->cond == BLK_ZONE_COND_EXP_OPEN)
+			rz_set_cond(z, zone, zone->wp == zone->start ? BLK_ZONE_COND_EMPTY : BLK_ZONE_COND_CLOSED);
+		break;
+	case REQ_OP_ZONE_FINISH:
+		rz_set_cond(z, zone, BLK_ZONE_COND_FULL);
+		zone->wp = rz_end(z, zone);
+		break;
+	default:
+		sts = BLK_STS_NOTSUPP;
+	}
+	spin_unlock(&z->lock);
+out:
+	spin_unlock(&zone->wlock);
+	return sts;
+}
+
+int ram_zone_report(struct ram_zoned *z, sector_t sector, unsigned int nr_zones,
+		report_zones_cb cb, void *data)
+{
+	unsigned int first = sector >> z->zone_shift, i;
+	struct blk_zone blkz;
+	int ret;
+
+	if (first >= z->nr_zones)
+		return 0;
+	nr_zones = min(nr_zones, z->nr_zones - first);
+	for (i = 0; i < nr_zones; i++) {
+		struct rz_zone *zone = &z->zones[first + i];
+
+		memset(&blkz, 0, sizeof(blkz));
+		blkz.start = zone->start;
+		blkz.len = z->zone_sectors;
+		blkz.capacity = z->zone_sectors;
+		spin_lock(&z->lock);                            /* A consistent wp/cond pair */
+		if (zone->conv) {
+			blkz.type = BLK_ZONE_TYPE_CONVENTIONAL;
+			blkz.cond = BLK_ZONE_COND_NOT_WP;
+			blkz.wp = rz_end(z, zone);
+		} else {
+			blkz.type = BLK_ZONE_TYPE_SEQWRITE_REQ;
+			blkz.cond = zone->cond;
+			blkz.wp = zone->wp;
+		}
+		spin_unlock(&z->lock);
+		ret = cb(&blkz, i, data);
+		if (ret)
+			return ret;
+	}
+	return nr_zones;
+}
+
+sector_t ram_zone_capacity(struct ram_zoned *z)
+{
+	return (sector_t)z->nr_zones << z->zone_shift;
+}
+
+struct ram_zoned *ram_zone_create(sector_t capacity, sector_t zone_sectors, unsigned int nr_conv,
+		unsigned int max_open, unsigned int max_active)
+{
+	struct ram_zoned *z;
+	unsigned int i;
+
+	if (!zone_sectors || !is_power_of_2(zone_sectors) || zone_sectors < RS_PAGE_SECTORS) {
+		pr_err("%s: zone size must be a power of 2 of at least a page\n", __func__);
+		return ERR_PTR(-EINVAL);
+	}
+	z = kzalloc(sizeof(*z), GFP_KERNEL);
+	if (!z)
+		return ERR_PTR(-ENOMEM);
+	z->zone_sectors = zone_sectors;
+	z->zone_shift = ilog2(zone_sectors);
+	z->nr_zones = capacity >> z->zone_shift;
+	if (!z->nr_zones || nr_conv >= z->nr_zones) {
+		pr_err("%s: %u zones with %u conventional: no sequential zone\n", __func__, z->nr_zones, nr_conv);
+		kfree(z);
+		return ERR_PTR(-EINVAL);
+	}
+	/* More open than active zones can't happen, and neither can more than there are */
+	z->max_active = max_active >= z->nr_zones - nr_conv ? 0 : max_active;
+	z->max_open = max_open >= z->nr_zones - nr_conv ? 0 : max_open;
+	if (z->max_active && (!z->max_open || z->max_open > z->max_active))
+		z->max_open = z->max_active;
+	spin_lock_init(&z->lock);
+	z->zones = kvcalloc(z->nr_zones, sizeof(*z->zones), GFP_KERNEL);
+	if (!z->zones) {
+		kfree(z);
+		return ERR_PTR(-ENOMEM);
+	}
+	for (i = 0; i < z->nr_zones; i++) {
+		struct rz_zone *zone = &z->zones[i];
+
+		spin_lock_init(&zone->wlock);
+		zone->start = (sector_t)i << z->zone_shift;
+		zone->wp = zone->start;
+		zone->conv = i < nr_conv;
+		zone->cond = zone->conv ? BLK_ZONE_COND_NOT_WP : BLK_ZONE_COND_EMPTY;
+	}
+	return z;
+}
+
+void ram_zone_destroy(struct ram_zoned *z)
+{
+	kvfree(z->zones);
+	kfree(z);
+}
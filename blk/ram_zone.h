@@ -0,0 +1,47 @@
+/*
+ * Host managed zoned emulation for the RAM block drivers
+ *
+ * The disk is cut into equal, power of 2 sized zones. The first nr_conv
+ * are conventional, the rest sequential write required: a write must
+ * land on the zone's write pointer (or be a zone append, which is put
+ * there), reset/open/close/finish move the zone between the ZBC
+ * conditions, and max_open / max_active limit the open and active
+ * (open + closed) zones like a real drive does.
+ *
+ * A writer holds its zone's write lock from the write pointer check
+ * through the copy to the pointer update, so writes of one zone are
+ * serialized while different zones go in parallel. The locks are
+ * spinlocks: the copy must not sleep.
+ */
+#ifndef _RAM_ZONE_H_
+#define _RAM_ZONE_H_
+
+#include <linux/blkdev.h>
+
+#include "ram_store.h"
+
+struct ram_zoned;
+
+/* capacity is cut down to whole zones, see ram_zone_capacity() */
+struct ram_zoned *ram_zone_create(sector_t capacity, sector_t zone_sectors, unsigned int nr_conv,
+		unsigned int max_open, unsigned int max_active);
+void ram_zone_destroy(struct ram_zoned *z);
+sector_t ram_zone_capacity(struct ram_zoned *z);
+
+/*
+ * Check a write of nr sectors at *sector, or an append to the zone
+ * holding *sector (then *sector becomes the write pointer), and take the
+ * zone's write lock. On BLK_STS_OK the caller copies the data and calls
+ * ram_zone_write_end() with the result, which moves the write pointer.
+ */
+blk_status_t ram_zone_write_begin(struct ram_zoned *z, bool append, sector_t *sector, unsigned int nr);
+void ram_zone_write_end(struct ram_zoned *z, sector_t sector, unsigned int nr, int error);
+
+/* REQ_OP_ZONE_RESET(_ALL)/OPEN/CLOSE/FINISH, a reset drops the zone's data from rs */
+blk_status_t ram_zone_mgmt(struct ram_zoned *z, struct ram_store *rs, unsigned int op, sector_t sector);
+
+/* block_device_operations.report_zones */
+int ram_zone_report(struct ram_zoned *z, sector_t sector, unsigned int nr_zones,
+		report_zones_cb cb, void *data);
+
+#endif
@@ -5,13 +5,20 @@
 #include <linux/types.h>
 #include <linux/genhd.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/slab.h>
-#include <linux/vmalloc.h>
 #include <linux/hdreg.h>
 #include <linux/kernel.h>
 #include <linux/version.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/sysfs.h>
+#include <linux/highmem.h>
 
 #include "ram.h"
+#include "ram_store.h"
+#include "ram_part.h"
+#include "ram_trace.h"
 
 #define DEVICE_NAME "blk_drv"
 #define KERNEL_SECTOR_SIZE 512
@@ -23,76 +30,120 @@ module_param(majornumber,int,0);
 MODULE_PARM_DESC(majornumber,"MAJOR NO. : Major number of logical block device driver.");
 static int logical_block_size=512;
 module_param(logical_block_size,int,0);
-MODULE_PARM_DESC(logical_block_size,"SECTOR SIZE");
+MODULE_PARM_DESC(logical_block_size,"SECTOR SIZE: 512 .. PAGE_SIZE, power of 2 (4096: 4K native)");
+static int physical_block_size=0;
+module_param(physical_block_size,int,0444);
+MODULE_PARM_DESC(physical_block_size,"Physical sector size reported to file systems (0: logical_block_size)");
 static int nsector=1024;
 module_param(nsector,int,0);
 MODULE_PARM_DESC(nsector,"Total device size:  nsector * logical_block_size");
+static int nr_hw_queues=0;
+module_param(nr_hw_queues,int,0444);
+MODULE_PARM_DESC(nr_hw_queues,"Number of hardware queues (0: one per CPU)");
+static int queue_depth=128;
+module_param(queue_depth,int,0444);
+MODULE_PARM_DESC(queue_depth,"Number of tags (in flight requests) per hardware queue");
+static char *part_layout="";
+module_param(part_layout,charp,0444);
+MODULE_PARM_DESC(part_layout,"Partitions: [mbr:|gpt:]<count> or [mbr:|gpt:]<size>,...[,-] (default: deff_partition_table)");
+static int part_align_kb=1024;
+module_param(part_align_kb,int,0444);
+MODULE_PARM_DESC(part_align_kb,"part_layout: partition start/size alignment");
+static int max_sectors_kb=4096;
+module_param(max_sectors_kb,int,0444);
+MODULE_PARM_DESC(max_sectors_kb,"Largest request the block layer may build (max_hw_sectors_kb)");
+static int nt_copy_kb=256;
+module_param(nt_copy_kb,int,0444);
+MODULE_PARM_DESC(nt_copy_kb,"Writes of at least this many KiB bypass the CPU caches (0: never)");
 
 
 /*Internal structure of Virtual block device*/
 typedef struct blk_dev{
-	int size;  
-	u8 *data;
+	u64 size;  
+	struct ram_store store;          /*Pages allocated on first write, holes read as zero*/
 	struct gendisk *gd;
 	struct request_queue *Queue;
-	spinlock_t lock;
-//	u8 *buffer;
+	struct blk_mq_tag_set tag_set;   /*Per CPU hardware contexts*/
+	struct mutex resize_lock;        /*Serializes writers of ramdisk/size*/
 }Dev;
 
 Dev *dev;
-static void copy_mbr(u8 *disk){
+static int copy_mbr(struct ram_store *store){
+	u8 disk[MBR_SIZE];
 	memset(disk, 0x0, MBR_SIZE);
 	*(unsigned long *)(disk + MBR_DISK_SIGNATURE_OFFSET) = 0x36E5756D;   /*Disk identifier*/
 	memcpy(disk + PARTITION_TABLE_OFFSET, &deff_partition_table, PARTITION_TABLE_SIZE);
 	*(unsigned short *)(disk + MBR_SIGNATURE_OFFSET) = MBR_SIGNATURE;   /*Partition sector have the endmark MBR_SIGNATURE(0xAA55) */
+	return ram_store_write(store,0,disk,MBR_SIZE,GFP_KERNEL);
 }
 //static int blkdrv_transfer(struct request *req,sector_t start_sector,unsigned long sector_cnt,u8 *buffer,int direction){
-static int blkdrv_transfer(struct request *req){
+/*
+ * Copy nbytes of one bvec. A bvec may span several pages and they may be
+ * in highmem, so every page gets its own short kmap_local_page() mapping
+ * (page_address() is only valid for lowmem pages).
+ */
+static int blkdrv_copy_bvec(Dev *dev,sector_t sector,const struct bio_vec *bv,unsigned int nbytes,int direction,bool nt){
+	struct page *page=bv->bv_page + (bv->bv_offset >> PAGE_SHIFT);
+	unsigned int offset=offset_in_page(bv->bv_offset);
+	unsigned int len;
+	u8 *buffer;
+	int ret=0;
+
+	while(nbytes && !ret){
+		len=min_t(unsigned int,nbytes,PAGE_SIZE - offset);
+		buffer=kmap_local_page(page);
+		/*queue_rq can't sleep, on ENOMEM the request is requeued*/
+		if(direction)
+			ret=nt ? ram_store_write_nt(&dev->store,sector,buffer + offset,len,GFP_NOWAIT) :
+				ram_store_write(&dev->store,sector,buffer + offset,len,GFP_NOWAIT);
+		else
+			ram_store_read(&dev->store,sector,buffer + offset,len);
+		kunmap_local(buffer);
+		sector += len >> SECTOR_SHIFT;
+		nbytes -= len;
+		offset=0;
+		page++;
+	}
+	return ret;
+}
+static int blkdrv_transfer(Dev *dev,struct request *req){
 	sector_t start_sector=blk_rq_pos(req);
 	unsigned int sector_cnt = blk_rq_sectors(req);
 	int direction=rq_data_dir(req);
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)) 
-#define  BV_PAGE(bv) ((bv)->bv_page)
-#define BV_OFFSET(bv) ((bv)->bv_offset)
-#define BV_LEN(bv) ((bv)->bv_len)
-	struct bio_vec *bv;
-#else 
-#define BV_PAGE(bv) ((bv).bv_page)
-#define BV_OFFSET(bv) ((bv).bv_offset)
-#define BV_LEN(bv) ((bv).bv_len)
+	/*Large writes are streamed past the CPU caches*/
+	bool nt=direction && nt_copy_kb > 0 && blk_rq_bytes(req) >= (unsigned int)nt_copy_kb * 1024;
 	struct bio_vec bv;
-#endif
 	struct req_iterator iter;
-	static unsigned int sectors;
+	unsigned int sectors;
 	sector_t offset;
 	unsigned long nbytes;
-	static int ret;
-	u8 *buffer;
+	int ret=0;
 	sector_t sector_offset;
 	sector_offset=0;
-	rq_for_each_segment(bv, req, iter){
-		buffer=page_address(BV_PAGE(bv) + BV_OFFSET(bv));
-		if( BV_LEN(bv) % logical_block_size !=0){
-			pr_err("%s: Should never happen: bio size (%d) is not a multiple of ''logical_block_size'' (%d)\n",__func__,BV_LEN(bv),logical_block_size);
+	rq_for_each_bvec(bv, req, iter){
+		/*
+		 * The block layer keeps whole requests logical_block_size aligned,
+		 * but one logical block may be split over two segments: a segment
+		 * is only guaranteed to be a multiple of 512 bytes.
+		 */
+		if( bv.bv_len % KERNEL_SECTOR_SIZE !=0){
+			pr_err("%s: Should never happen: bio size (%d) is not a multiple of KERNEL_SECTOR_SIZE (%d)\n",__func__,bv.bv_len,KERNEL_SECTOR_SIZE);
 			ret = -EIO;
 		}
-		sectors = BV_LEN(bv)/logical_block_size;
-		pr_info("%s: Start Sector: %llu, Sector Offset: %llu; Buffer: %p; Length: %u sectors\n",__func__,
-				(unsigned long long)(start_sector), (unsigned long long)(sector_offset), buffer, sectors);
+		sectors = bv.bv_len >> SECTOR_SHIFT;
 
+		/*blk_rq_pos() counts 512 byte sectors whatever logical_block_size is*/
 		offset= (start_sector + sector_offset);
-		nbytes= sectors *logical_block_size;
-		if(direction)
-			memcpy(dev->data + offset * logical_block_size ,buffer,nbytes);
-		else
-			memcpy(buffer,dev->data + offset * logical_block_size ,nbytes);
+		nbytes= (unsigned long)sectors << SECTOR_SHIFT;
+		trace_ramdisk_segment(dev->gd,direction,offset,nbytes);
+		if(blkdrv_copy_bvec(dev,offset,&bv,nbytes,direction,nt))
+			return -ENOMEM;
 		sector_offset += sectors;
 	}
 	if(sector_offset != sector_cnt){
 		pr_err("%s: Bio info doesn't match with the request info\n",__func__);
 		ret = -EIO;
 	}
-	pr_info("ret value===%d\n",ret);
 	return ret;
 }
 /*
@@ -103,26 +154,34 @@ static int blkdrv_transfer(struct request *req){
  * blk_rq_sectors()             : sectors left in the entire request
  * blk_rq_cur_sectors()         : sectors left in the current segment
  */
-static void blkdrv_req(struct request_queue *q){
-	struct request *req;
+static blk_status_t blkdrv_queue_rq(struct blk_mq_hw_ctx *hctx,const struct blk_mq_queue_data *bd){
+	struct request *req=bd->rq;
+	Dev *dev=hctx->queue->queuedata;
 	int ret;
-	while((req=blk_fetch_request(q)) != NULL){
-	/*(	if(req==NULL && req->cmd_type!=REQ_TYPE_FS){
-			pr_err("%s: Request type is not FS(REQ_TYPE_FS) type\n",__func__);
-			__blk_end_request_all(req,-EIO);
-			continue;
-		}*/
-	//	ret=blkdrv_transfer(req,blk_rq_pos(req),blk_rq_sectors(req),dev->buffer,rq_data_dir(req));
-		ret=blkdrv_transfer(req);
-		__blk_end_request_all(req,ret);
-/*		if(!__blk_end_request_cur(req,0)){
-		//	req=blk_fetch_request(q);
-//		__blk_end_request(req, ret, blk_rq_bytes(req));
-		//	__blk_end_request_all(req,ret);
-		}*/
+
+	blk_mq_start_request(req);
+	if(blk_rq_is_passthrough(req)){
+		pr_err("%s: Request type is not FS(REQ_OP_READ/WRITE) type\n",__func__);
+		blk_mq_end_request(req,BLK_STS_IOERR);
+		return BLK_STS_OK;
+	}
+	trace_ramdisk_issue(dev->gd,req_op(req),blk_rq_pos(req),blk_rq_bytes(req),0);
+	if(req_op(req)==REQ_OP_DISCARD || req_op(req)==REQ_OP_WRITE_ZEROES){
+		ram_store_discard(&dev->store,blk_rq_pos(req),blk_rq_bytes(req));   /*Frees the backing pages*/
+		ret=0;
+		goto end;
 	}
-	
+	ret=blkdrv_transfer(dev,req);
+	if(ret==-ENOMEM)
+		return BLK_STS_RESOURCE;
+end:
+	trace_ramdisk_complete(dev->gd,req_op(req),blk_rq_pos(req),blk_rq_bytes(req),ret);
+	blk_mq_end_request(req,errno_to_blk_status(ret));
+	return BLK_STS_OK;
 }
+static const struct blk_mq_ops blkdrv_mq_ops = {
+	.queue_rq = blkdrv_queue_rq,
+};
 static int blkdrv_getgeo(struct block_device *blk_dev, struct hd_geometry *geo){
 	geo->heads= 1;
 	geo->cylinders= 32 ;
@@ -148,61 +207,175 @@ static const struct block_device_operations blkdrv_fops = {
 	.getgeo  = blkdrv_getgeo,
 };
 
+/*
+ * Online resize. Growing only moves the capacity: pages are allocated on
+ * first write anyway. Shrinking is refused with -EBUSY while any page
+ * beyond the new end still holds data; the queue is frozen around the
+ * check so no I/O can land in the tail meanwhile.
+ */
+static int blkdrv_resize(Dev *dev,sector_t new){
+	sector_t old;
+	int ret=0;
+
+	mutex_lock(&dev->resize_lock);
+	old=get_capacity(dev->gd);
+	if(new<old){
+		blk_mq_freeze_queue(dev->Queue);
+		if(!ram_store_range_empty(&dev->store,new,old-new))
+			ret=-EBUSY;
+		else{
+			ram_store_discard(&dev->store,new,(size_t)(old-new) << SECTOR_SHIFT);   /*Zero the partial page at the new end*/
+			set_capacity_and_notify(dev->gd,new);
+		}
+		blk_mq_unfreeze_queue(dev->Queue);
+	}
+	else if(new>old)
+		set_capacity_and_notify(dev->gd,new);
+	if(!ret)
+		dev->size=(u64)new << SECTOR_SHIFT;
+	mutex_unlock(&dev->resize_lock);
+	if(!ret && new!=old)
+		pr_info("%s: %s resized from %llu to %llu sectors\n",__func__,dev->gd->disk_name,
+			(unsigned long long)old,(unsigned long long)new);
+	return ret;
+}
+/*
+ * /sys/block/vd/ramdisk/size: capacity in 512 byte sectors. The gendisk
+ * already owns a read only "size" file, hence the named group.
+ */
+static ssize_t size_show(struct device *d,struct device_attribute *attr,char *buf){
+	return sysfs_emit(buf,"%llu\n",(unsigned long long)get_capacity(dev_to_disk(d)));
+}
+static ssize_t size_store(struct device *d,struct device_attribute *attr,const char *buf,size_t count){
+	Dev *dev=dev_to_disk(d)->private_data;
+	u64 new;
+	int ret;
+
+	ret=kstrtoull(buf,0,&new);
+	if(ret)
+		return ret;
+	if(!new || new % (logical_block_size >> SECTOR_SHIFT))           /*Whole logical blocks only*/
+		return -EINVAL;
+	ret=blkdrv_resize(dev,new);
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(size);
+
+static struct attribute *blkdrv_attrs[]={
+	&dev_attr_size.attr,
+	NULL,
+};
+static const struct attribute_group blkdrv_attr_grp={
+	.name="ramdisk",
+	.attrs=blkdrv_attrs,
+};
+static const struct attribute_group *blkdrv_attr_groups[]={
+	&blkdrv_attr_grp,
+	NULL,
+};
+
 static int blkdrv_init(void){
+	int ret;
+
 	pr_info("%s: Initialization of Block device driver\n",__func__);
-	dev=kmalloc(sizeof(struct blk_dev),GFP_KERNEL);
-	dev->size=logical_block_size*nsector;
-	spin_lock_init(&dev->lock);
-	dev->data=vmalloc(dev->size);
-	if(!dev->data){
-		pr_err("%s: Vmalloc allocation failed\n",__func__);
+	if(logical_block_size < KERNEL_SECTOR_SIZE || logical_block_size > PAGE_SIZE || !is_power_of_2(logical_block_size)){
+		pr_err("%s: Invalid logical_block_size %d\n",__func__,logical_block_size);
+		return -EINVAL;
+	}
+	if(!physical_block_size)
+		physical_block_size=logical_block_size;
+	if(physical_block_size < logical_block_size || !is_power_of_2(physical_block_size)){
+		pr_err("%s: Invalid physical_block_size %d\n",__func__,physical_block_size);
+		return -EINVAL;
+	}
+	dev=kzalloc(sizeof(struct blk_dev),GFP_KERNEL);
+	if(!dev)
 		return -ENOMEM;
+	dev->size=(u64)logical_block_size*nsector;
+	mutex_init(&dev->resize_lock);
+	ret=ram_store_init(&dev->store);                                                                 /*Nothing is committed until written*/
+	if(!ret && *part_layout)                                                                        /*Table sized for this disk, counted in logical blocks*/
+		ret=ram_part_write(&dev->store,(sector_t)nsector*(logical_block_size>>9),logical_block_size,part_layout,
+			part_align_kb > 0 ? part_align_kb<<10 : logical_block_size);
+	else if(!ret)
+		ret=copy_mbr(&dev->store);                                                             /*Copy disk partition table*/
+	if(ret){
+		pr_err("%s: Partition table allocation failed\n",__func__);
+		goto free;
 	}
-	copy_mbr(dev->data);                                                                           /*Copy disk partition table*/
 	/*device regidtration*/
 	majornumber=register_blkdev(0,DEVICE_NAME);
 	if(majornumber < 0){
 		pr_err("%s: BLOCK device registeration failed\n",__func__);
+		ret=majornumber;
 		goto free;
 	}
-	dev->Queue=blk_init_queue(blkdrv_req,&dev->lock);
-	if(!dev->Queue){
-		pr_err("blk_init_queue: Queue Initialization Failed\n");
-		goto free;
-	}
-//	blk_queue_logical_block_size(dev->Queue,logical_block_size);
-	dev->gd=alloc_disk(MINOR_NO);
-	if(!dev->gd){
-		pr_err("GENDISK: alloc_disc Allocation failed\n");
+	dev->tag_set.ops=&blkdrv_mq_ops;
+	dev->tag_set.nr_hw_queues=nr_hw_queues > 0 ? nr_hw_queues : nr_cpu_ids;
+	dev->tag_set.queue_depth=queue_depth > 0 ? queue_depth : 128;
+	dev->tag_set.numa_node=NUMA_NO_NODE;
+	dev->tag_set.flags=BLK_MQ_F_SHOULD_MERGE;
+	dev->tag_set.driver_data=dev;
+	ret=blk_mq_alloc_tag_set(&dev->tag_set);
+	if(ret){
+		pr_err("blk_mq_alloc_tag_set: Tag set allocation failed\n");
 		goto unregister;
 	}
+	dev->gd=blk_mq_alloc_disk(&dev->tag_set,dev);
+	if(IS_ERR(dev->gd)){
+		pr_err("GENDISK: blk_mq_alloc_disk Allocation failed\n");
+		ret=PTR_ERR(dev->gd);
+		goto free_tags;
+	}
+	dev->Queue=dev->gd->queue;
+	/*
+	 * 4K native (logical_block_size=4096) makes file systems issue page
+	 * sized, page aligned I/O: one store page per block, no read-modify
+	 * of partial pages and half the per-I/O overhead of 512e.
+	 */
+	blk_queue_logical_block_size(dev->Queue,logical_block_size);
+	blk_queue_physical_block_size(dev->Queue,physical_block_size);
+	blk_queue_io_min(dev->Queue,physical_block_size);
+	blk_queue_io_opt(dev->Queue,max_t(unsigned int,physical_block_size,PAGE_SIZE));
+	/*No DMA: segments of any size and number, only the request size is bounded*/
+	blk_queue_max_segment_size(dev->Queue,UINT_MAX);
+	blk_queue_max_segments(dev->Queue,USHRT_MAX);
+	blk_queue_max_hw_sectors(dev->Queue,max_sectors_kb > 0 ? max_sectors_kb << 1 : BLK_SAFE_MAX_SECTORS);
+	dev->Queue->limits.discard_granularity=PAGE_SIZE;
+	blk_queue_max_discard_sectors(dev->Queue,UINT_MAX);
+	blk_queue_max_write_zeroes_sectors(dev->Queue,UINT_MAX);
+	blk_queue_flag_set(QUEUE_FLAG_DISCARD,dev->Queue);
 	dev->gd->major=majornumber;
-//	dev->gd->first_minor=0;
-	dev->gd->minors=16;
+	dev->gd->first_minor=0;
+	dev->gd->minors=MINOR_NO;
 	dev->gd->fops=&blkdrv_fops;
-	dev->gd->private_data=&dev;
-	dev->gd->queue=dev->Queue;
+	dev->gd->private_data=dev;
 	strcpy(dev->gd->disk_name,"vd");
-	set_capacity(dev->gd,nsector);
-	add_disk(dev->gd);
-	pr_info(": Ram Block driver initialised (%d sectors; %d bytes)\n",
-		nsector, dev->size);
+	set_capacity(dev->gd,(sector_t)nsector * (logical_block_size >> SECTOR_SHIFT));   /*Capacity is always in 512 byte units*/
+	ret=device_add_disk(NULL,dev->gd,blkdrv_attr_groups);
+	if(ret)
+		goto cleanup_disk;
+	pr_info(": Ram Block driver initialised (%d sectors; %llu bytes; %u hw queues)\n",
+		nsector, dev->size, dev->tag_set.nr_hw_queues);
 	return 0;
+cleanup_disk:
+	blk_cleanup_disk(dev->gd);
+free_tags:
+	blk_mq_free_tag_set(&dev->tag_set);
 unregister:
-	blk_cleanup_queue(dev->Queue);
 	unregister_blkdev(majornumber,DEVICE_NAME);
 free:
-	vfree(dev->data);
+	ram_store_free(&dev->store);
 	kfree(dev);
-	return 0;
+	return ret;
 }
 
 static void __exit blkdrv_exit(void){
 	del_gendisk(dev->gd);
-	put_disk(dev->gd);
+	blk_cleanup_disk(dev->gd);
+	blk_mq_free_tag_set(&dev->tag_set);
 	unregister_blkdev(majornumber,DEVICE_NAME);
-	blk_cleanup_queue(dev->Queue);
-	vfree(dev->data);
+	ram_store_free(&dev->store);
 	kfree(dev);
 	pr_info("%s: Exited Successfully\n",__func__);
 }
@@ -1,7 +1,7 @@
 /*
  * Block driver 
  *
- * This driver is based on  3.10.X kernel. 
+ * This driver is based on  5.15.X kernel (blk-mq). 
  * but has been rewritten to be easier to read and use.
  */
 #include <linux/module.h>
@@ -12,60 +12,210 @@
 #include <linux/spinlock.h>
 #include <linux/genhd.h> 
 #include <linux/blkdev.h> 
+#include <linux/blk-mq.h>
 #include <linux/hdreg.h> 
 #include <linux/errno.h>
-#include <linux/vmalloc.h>
 #include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/sysfs.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/highmem.h>
+#include <linux/rculist.h>
+#include <linux/nodemask.h>
 
 #include "partition_info.h"
+#include "ram_store.h"
+#include "ram_comp.h"
+#include "ram_dedup.h"
+#include "ram_wb.h"
+#include "ram_image.h"
+#include "ram_part.h"
+#include "ram_zone.h"
+#include "ram_stats.h"
+#include "ram_fault.h"
+#include "ram_snap.h"
+#include "ram_trace.h"
 
 #define FIRST_MINOR 0
 #define MINOR_CNT 16
-#define DEVICE_SIZE 1024 /* sectors */
-/* So, total device size = 1024 * 512 bytes = 512 KiB */
+#define DEVICE_SIZE 1024 /* default sectors per disk */
+/* So, default device size = 1024 * 512 bytes = 512 KiB */
+#define RB_MAX_DEVICES 16 /* vda .. vdp */
+#define RB_MAX_SNAPS 16 /* per disk: vda-snap1, vda-snap2, ... */
 #define SECTOR_SIZE 512
 #define SIZE(a) (sizeof(a) / sizeof(*a))
 
 static u_int majornumber = 0;
 int i; 
 
+static int rd_nr = 1;
+module_param(rd_nr, int, 0444);
+MODULE_PARM_DESC(rd_nr, "Number of ram disks to create: vda, vdb, ... (max 16)");
+static int nsector[RB_MAX_DEVICES];
+static int nr_nsector;
+module_param_array(nsector, int, &nr_nsector, 0444);
+MODULE_PARM_DESC(nsector, "Size of each disk in sectors, comma separated (default 1024)");
+
+#define RB_Q_BIO 0 /* bio based: submit_bio, no request layer */
+#define RB_Q_MQ  1 /* request based: blk-mq queue_rq */
+
+static int queue_mode = RB_Q_MQ;
+module_param(queue_mode, int, 0444);
+MODULE_PARM_DESC(queue_mode, "Block interface to use (0: bio based, 1: blk-mq)");
+static int nr_hw_queues = 0;
+module_param(nr_hw_queues, int, 0444);
+MODULE_PARM_DESC(nr_hw_queues, "Number of hardware queues (0: one per CPU)");
+static int poll_queues = 0;
+module_param(poll_queues, int, 0444);
+MODULE_PARM_DESC(poll_queues, "blk-mq: extra hardware queues for polled I/O (io_uring IOPOLL, RWF_HIPRI)");
+static int max_sectors_kb = 4096;
+module_param(max_sectors_kb, int, 0444);
+MODULE_PARM_DESC(max_sectors_kb, "Largest request the block layer may build (max_hw_sectors_kb)");
+static int nt_copy_kb = 256;
+module_param(nt_copy_kb, int, 0444);
+MODULE_PARM_DESC(nt_copy_kb, "Writes of at least this many KiB bypass the CPU caches (0: never)");
+static int queue_depth = 128;
+module_param(queue_depth, int, 0444);
+MODULE_PARM_DESC(queue_depth, "Number of tags (in flight requests) per hardware queue");
+static int async_kb = 0;
+module_param(async_kb, int, 0444);
+MODULE_PARM_DESC(async_kb, "blk-mq: requests of at least this many KiB are served by a worker pool (0: all inline)");
+static bool async_unbound = false;
+module_param(async_unbound, bool, 0444);
+MODULE_PARM_DESC(async_unbound, "Worker pool is NUMA node local (unbound) instead of per CPU");
+static int numa_mode = RS_NUMA_LOCAL;
+module_param(numa_mode, int, 0444);
+MODULE_PARM_DESC(numa_mode, "Backing page placement (0: first touch, 1: interleave over online nodes, 2: bind to numa_node)");
+static int numa_node = NUMA_NO_NODE;
+module_param(numa_node, int, 0444);
+MODULE_PARM_DESC(numa_node, "Node for numa_mode=2; the tag set and queue are allocated there as well");
+static char *compress = "";
+module_param(compress, charp, 0444);
+MODULE_PARM_DESC(compress, "Keep the data compressed with this algorithm, e.g. lz4 or lzo (default: off)");
+static bool dedup = false;
+module_param(dedup, bool, 0444);
+MODULE_PARM_DESC(dedup, "Store identical pages once (not with compress or backing_dev)");
+static char *backing_dev[RB_MAX_DEVICES];
+static int nr_backing_dev;
+module_param_array(backing_dev, charp, &nr_backing_dev, 0444);
+MODULE_PARM_DESC(backing_dev, "Block device each disk caches in write-back mode, comma separated (the disk takes its size)");
+static int wb_dirty_ratio = 20;
+module_param(wb_dirty_ratio, int, 0444);
+MODULE_PARM_DESC(wb_dirty_ratio, "backing_dev: percent of RAM that may be dirty before writers wait");
+static int wb_background_ratio = 10;
+module_param(wb_background_ratio, int, 0444);
+MODULE_PARM_DESC(wb_background_ratio, "backing_dev: percent of RAM dirty that starts the flusher");
+static int wb_interval_ms = 1000;
+module_param(wb_interval_ms, int, 0444);
+MODULE_PARM_DESC(wb_interval_ms, "backing_dev: flusher period while anything is dirty");
+static int wb_batch_kb = 1024;
+module_param(wb_batch_kb, int, 0444);
+MODULE_PARM_DESC(wb_batch_kb, "backing_dev: largest write sent to the backing device (max 1024)");
+static int wb_cache_ratio = 50;
+module_param(wb_cache_ratio, int, 0444);
+MODULE_PARM_DESC(wb_cache_ratio, "backing_dev: percent of RAM the cache may hold before clean pages are dropped");
+static char *image[RB_MAX_DEVICES];
+static int nr_image;
+module_param_array(image, charp, &nr_image, 0444);
+MODULE_PARM_DESC(image, "Image file per disk, comma separated: restored at load when it exists, saved at unload");
+static char *part_layout = "";
+module_param(part_layout, charp, 0444);
+MODULE_PARM_DESC(part_layout, "Partition every disk: [mbr:|gpt:]<count> or [mbr:|gpt:]<size>,...[,-] (default: the static 1024 sector tables)");
+static int part_align_kb = 1024;
+module_param(part_align_kb, int, 0444);
+MODULE_PARM_DESC(part_align_kb, "part_layout: partition start/size alignment");
+static bool zoned = false;
+module_param(zoned, bool, 0444);
+MODULE_PARM_DESC(zoned, "Host managed zoned disks (blk-mq only, not with compress, backing_dev or image)");
+static int zone_size_kb = 256;
+module_param(zone_size_kb, int, 0444);
+MODULE_PARM_DESC(zone_size_kb, "zoned: zone size, a power of 2");
+static int zone_nr = 0;
+module_param(zone_nr, int, 0444);
+MODULE_PARM_DESC(zone_nr, "zoned: zones per disk, sets the disk size (0: as many as fit in nsector)");
+static int zone_nr_conv = 0;
+module_param(zone_nr_conv, int, 0444);
+MODULE_PARM_DESC(zone_nr_conv, "zoned: conventional (randomly writable) zones at the start of the disk");
+static int zone_max_open = 0;
+module_param(zone_max_open, int, 0444);
+MODULE_PARM_DESC(zone_max_open, "zoned: open zone limit (0: none)");
+static int zone_max_active = 0;
+module_param(zone_max_active, int, 0444);
+MODULE_PARM_DESC(zone_max_active, "zoned: active (open or closed) zone limit (0: none)");
+
 typedef struct rb_device
 {
-	unsigned int size;
-	u8 *data;
+	int index;                                       /* vda = 0, vdb = 1, ... */
+	u64 size;                                        /* bytes */
+	struct ram_store store;                          /* Sparse pages, allocated on first write */
 	struct gendisk *gd;
 	struct request_queue *Queue;
-	spinlock_t lock;
-	u8 *buffer;
+	struct blk_mq_tag_set tag_set;                   /* One hardware context per CPU, no shared queue lock */
+	struct mutex resize_lock;                        /* Serializes writers of ramdisk/size and the snapshots */
+	struct ram_stats stats;                          /* debugfs: vd/<disk>/{stats,latency} */
+	struct ram_fault fault;                          /* debugfs: vd/<disk>/{delay,bandwidth,errors} */
+	struct ram_wb *wb;                               /* Only with backing_dev= */
+	const char *image;                               /* Only with image= */
+	struct ram_zoned *zoned;                         /* Only with zoned=1 */
+	struct list_head snaps;                          /* CoW snapshots, oldest first, see ram_snap.h */
+	unsigned int nr_snaps;
+	unsigned int snap_seq;                           /* Id of the last snapshot taken */
 }Dev;
 
-Dev *dev;
+/* Every disk has its own store, tag set and queue: nothing is shared between them */
+static Dev *devices[RB_MAX_DEVICES];
+static struct dentry *blkdrv_debugfs;                    /* /sys/kernel/debug/vd */
+static struct workqueue_struct *blkdrv_async_wq;         /* Only with async_kb > 0 */
+
+/* Per request driver data, tag_set.cmd_size */
+struct blkdrv_cmd {
+	struct work_struct work;                         /* Large request served off the dispatch path */
+	u64 start;                                       /* ktime_get_ns() at request start */
+	struct hrtimer timer;                            /* Holds the completion for an injected delay */
+	blk_status_t status;                             /* What the held completion reports */
+};
+
+/* Per hardware context driver data, hctx->driver_data */
+struct blkdrv_queue {
+	spinlock_t poll_lock;
+	struct list_head poll_list;                      /* Served requests waiting for blkdrv_poll() */
+};
 
 #if BR
-static void copy_br(u8 *disk,int start_cylinder, const PartitionTable *part_table){
-	disk+=(start_cylinder * 32 * SECTOR_SIZE);            /*Total sectors of extended partition / Total no of  Cylinder = 320/10 =32*/
+static int copy_br(struct ram_store *store,int start_cylinder, const PartitionTable *part_table){
+	u8 disk[BR_SIZE];
+	sector_t sector = start_cylinder * 32;                /*Total sectors of extended partition / Total no of  Cylinder = 320/10 =32*/
+
 	memset(disk, 0x0, BR_SIZE);
 	memcpy(disk + PARTITION_TABLE_OFFSET,part_table,PARTITION_TABLE_SIZE);
 	*(unsigned short *)(disk + BR_SIGNATURE_OFFSET) = BR_SIGNATURE;
+	return ram_store_write(store, sector, disk, BR_SIZE, GFP_KERNEL);
 }
-void copy_br_partition_data(u8 *disk){
-	int i;
+static int copy_br_partition_data(struct ram_store *store){
+	int i, ret;
 	for(i=0;i<SIZE(different_log_part_table);i++){
-		copy_br(disk,different_log_part_br_cyl[i],&different_log_part_table[i]);
+		ret = copy_br(store,different_log_part_br_cyl[i],&different_log_part_table[i]);
+		if (ret)
+			return ret;
 	}
+	return 0;
 }
 #endif
 
-static void copy_mbr(u8 *disk){
+static int copy_mbr(struct ram_store *store){
+	u8 disk[MBR_SIZE];
+
 	memset(disk, 0x0, MBR_SIZE);
 	*(unsigned long *)(disk + MBR_DISK_SIGNATURE_OFFSET) = 0x36E5756D;
 	memcpy(disk + PARTITION_TABLE_OFFSET, &different_partition_table, PARTITION_TABLE_SIZE);
 	*(unsigned short *)(disk + MBR_SIGNATURE_OFFSET) = MBR_SIGNATURE;
+	return ram_store_write(store, 0, disk, MBR_SIZE, GFP_KERNEL);
 }
 
 static int blkdrv_open(struct block_device *bdev, fmode_t mode)
 {
-	unsigned unit = iminor(bdev->bd_inode);
+	unsigned unit = iminor(bdev->bd_inode) - bdev->bd_disk->first_minor;
 
 	pr_info("blk_drv: Device is opened\n");
 	pr_info("blk_drv: Inode number is %d\n", unit);
@@ -91,58 +241,109 @@ static void blkdrv_close(struct gendisk *disk, fmode_t mode)
 static int blkdrv_getgeo(struct block_device *bdev, struct hd_geometry *geo)
 {
 	geo->heads = 1;
-	geo->cylinders = 32;
+	geo->cylinders = min_t(sector_t, get_capacity(bdev->bd_disk) / 32, 0xffff);
 	geo->sectors = 32;
 	geo->start = 0;
 	return 0;
 }
 
-//static int blkdrv_transfer(struct request *req)
-static int blkdrv_transfer(struct request *req,sector_t start_sector,unsigned int sector_cnt,u8 *buffer,int direction){
-/*	int direction = rq_data_dir(req);
-	sector_t start_sector = blk_rq_pos(req);
-	unsigned int sector_cnt = blk_rq_sectors(req);
-*/
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0))
-#define BV_PAGE(bv) ((bv)->bv_page)
-#define BV_OFFSET(bv) ((bv)->bv_offset)
-#define BV_LEN(bv) ((bv)->bv_len)
-	struct bio_vec *bv;
-#else
-#define BV_PAGE(bv) ((bv).bv_page)
-#define BV_OFFSET(bv) ((bv).bv_offset)
-#define BV_LEN(bv) ((bv).bv_len)
-	struct bio_vec bv;
-#endif
+/*
+ * With snapshots, the newest one gets a copy of whatever a write or a
+ * discard is about to change (once per page). The list can't change
+ * while origin I/O is in flight, see blkdrv_snap_create().
+ */
+static int blkdrv_preserve(Dev *dev, sector_t sector, size_t n, gfp_t gfp)
+{
+	if (list_empty(&dev->snaps))
+		return 0;
+	return ram_snap_preserve(list_last_entry(&dev->snaps, struct ram_snap, node), &dev->store, sector, n, gfp);
+}
+
+/*
+ * Copy one segment between the caller's buffer and the ram disk,
+ * shared by the request (blk-mq) and the bio based paths. A write fails
+ * with -ENOMEM when a backing page can't be allocated with gfp; with a
+ * backing device both directions may also fail with its I/O errors.
+ * nt writes bypass the CPU caches (not through the write-back cache,
+ * whose pages are read again by the flusher soon).
+ */
+static int blkdrv_copy(Dev *dev,sector_t sector,u8 *buffer,unsigned long nbytes,int direction,gfp_t gfp,bool nt){
+	int ret;
+
+	if (dev->wb)
+		return direction ? ram_wb_write(dev->wb, sector, buffer, nbytes, gfp) :
+			ram_wb_read(dev->wb, sector, buffer, nbytes);
+	if(direction){ /* Write to the device */
+		ret = blkdrv_preserve(dev, sector, nbytes, gfp);
+		if (ret)
+			return ret;
+		return nt ? ram_store_write_nt(&dev->store, sector, buffer, nbytes, gfp) :
+			ram_store_write(&dev->store, sector, buffer, nbytes, gfp);
+	}
+	/* Read from the device */
+	ram_store_read(&dev->store, sector, buffer, nbytes);
+	return 0;
+}
+
+/*
+ * Copy nbytes of a bvec, which may span several pages (multi-page bvec).
+ * The pages may be in highmem: each one is mapped on its own with
+ * kmap_local_page() for just its part of the copy.
+ */
+static int blkdrv_copy_bvec(Dev *dev,sector_t sector,const struct bio_vec *bv,unsigned int nbytes,int direction,
+		gfp_t gfp,bool nt){
+	struct page *page = bv->bv_page + (bv->bv_offset >> PAGE_SHIFT);
+	unsigned int offset = offset_in_page(bv->bv_offset);
+	int ret = 0;
+
+	while (nbytes && !ret){
+		unsigned int len = min_t(unsigned int, nbytes, PAGE_SIZE - offset);
+		u8 *buffer = kmap_local_page(page);
+
+		ret = blkdrv_copy(dev, sector, buffer + offset, len, direction, gfp, nt);
+		kunmap_local(buffer);
+		sector += len >> SECTOR_SHIFT;
+		nbytes -= len;
+		offset = 0;
+		page++;
+	}
+	return ret;
+}
+
+/* Large writes stream into the store with non-temporal stores */
+static bool blkdrv_nt(Dev *dev, int direction, unsigned int bytes)
+{
+	return direction && nt_copy_kb > 0 && !dev->wb && bytes >= (unsigned int)nt_copy_kb * 1024;
+}
+
+static int blkdrv_transfer(Dev *dev,struct request *req,sector_t start_sector,unsigned int sector_cnt,int direction,gfp_t gfp){
+	bool nt = blkdrv_nt(dev, direction, blk_rq_bytes(req));
 	struct req_iterator iter;
+	struct bio_vec bv;
 
 	sector_t sector_offset;
 	unsigned int sectors;
-//	u8 *buffer;
-	sector_t offset;
-	unsigned long nbytes;
-	int ret = 0;
-
-//	pr_debug("blk_drv: Dir:%d; Sec:%lld; Cnt:%d\n", dir, start_sector, sector_cnt);
+	int ret = 0, err;
 
+	/* An injected error fails the request before anything is copied */
+	err = ram_fault_error(&dev->fault, direction, start_sector, sector_cnt);
+	if (err)
+		return err;
 	sector_offset = 0;
-	rq_for_each_segment(bv, req, iter)
+	/* Whole bvecs, not page sized segments: one iteration per physically contiguous run */
+	rq_for_each_bvec(bv, req, iter)
 	{
-		buffer = page_address(BV_PAGE(bv)) + BV_OFFSET(bv);
-		if (BV_LEN(bv) % SECTOR_SIZE != 0){
+		if (bv.bv_len % SECTOR_SIZE != 0){
 			pr_err("blk_drv: Should never happen: " "bio size (%d) is not a multiple of SECTOR_SIZE (%d).\n"
-					"This may lead to data truncation.\n",BV_LEN(bv), SECTOR_SIZE);
+					"This may lead to data truncation.\n",bv.bv_len, SECTOR_SIZE);
 			ret = -EIO;
 		}
-		sectors = BV_LEN(bv) / SECTOR_SIZE;
-		pr_info("blk_drv: Start Sector: %llu, Sector Offset: %llu; Buffer: %p; Length: %u sectors\n",
-			(unsigned long long)(start_sector), (unsigned long long)(sector_offset), buffer, sectors);
-		offset = (start_sector + sector_offset) * SECTOR_SIZE ;
-		nbytes =  sectors * SECTOR_SIZE ;
-		if(direction) /* Write to the device */
-			memcpy(dev->data + offset,buffer,nbytes);
-		else /* Read from the device */
-			memcpy(buffer,dev->data + offset,nbytes);
+		sectors = bv.bv_len / SECTOR_SIZE;
+		trace_ramdisk_segment(dev->gd, direction, start_sector + sector_offset, bv.bv_len);
+		/* From queue_rq gfp can't sleep: a failed allocation is retried by requeueing */
+		err = blkdrv_copy_bvec(dev, start_sector + sector_offset, &bv, sectors * SECTOR_SIZE, direction, gfp, nt);
+		if (err)
+			return err;
 		sector_offset += sectors;
 	}
 	if (sector_offset != sector_cnt){
@@ -152,91 +353,1066 @@ static int blkdrv_transfer(struct request *req,sector_t start_sector,unsigned in
 
 	return ret;
 }
-static void blkdrv_request(struct request_queue *q){
-	struct request *req;
+/*
+ * Bio based fast path (queue_mode=0): no elevator, no request allocation,
+ * no tag and no completion softirq. The bio is served and ended in the
+ * context of the submitter.
+ */
+static blk_qc_t blkdrv_submit_bio(struct bio *bio){
+	Dev *dev = bio->bi_bdev->bd_disk->private_data;
+	sector_t sector = bio->bi_iter.bi_sector;
+	unsigned int bytes = bio->bi_iter.bi_size;
+	u64 start = ktime_get_ns();
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	int direction, ret;
+	bool nt;
+
+	trace_ramdisk_issue(dev->gd, bio_op(bio), sector, bytes, 0);
+	switch (bio_op(bio)) {
+	case REQ_OP_READ:
+	case REQ_OP_WRITE:
+		break;
+	case REQ_OP_FLUSH:                                     /* Nothing volatile to flush without a backing device */
+		if (dev->wb)
+			bio->bi_status = errno_to_blk_status(ram_wb_flush(dev->wb));
+		ram_stats_account(&dev->stats, RS_DIR_FLUSH, 0, 0, start, bio->bi_status != BLK_STS_OK);
+		bio_endio(bio);
+		return BLK_QC_T_NONE;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		ret = blkdrv_preserve(dev, sector, bytes, GFP_NOIO);
+		if (!ret)
+			ram_store_discard(&dev->store, sector, bytes);
+		bio->bi_status = errno_to_blk_status(ret);
+		ram_stats_account(&dev->stats, RS_DIR_DISCARD, bytes, 0, start, ret);
+		trace_ramdisk_complete(dev->gd, bio_op(bio), bio->bi_iter.bi_sector, bytes, ret);
+		bio_endio(bio);
+		return BLK_QC_T_NONE;
+	default:
+		bio->bi_status = BLK_STS_NOTSUPP;
+		bio_endio(bio);
+		return BLK_QC_T_NONE;
+	}
+	direction = op_is_write(bio_op(bio));
+	if (bio_end_sector(bio) > get_capacity(dev->gd) ||
+	    ram_fault_error(&dev->fault, direction, sector, bio_sectors(bio))){
+		bio->bi_status = BLK_STS_IOERR;
+		goto out;
+	}
+	if (dev->wb && (bio->bi_opf & REQ_PREFLUSH)){
+		bio->bi_status = errno_to_blk_status(ram_wb_flush(dev->wb));
+		if (bio->bi_status)
+			goto out;
+	}
+	nt = blkdrv_nt(dev, direction, bytes);
+	bio_for_each_bvec(bv, bio, iter) {
+		ret = blkdrv_copy_bvec(dev, sector, &bv, bv.bv_len, direction, GFP_NOIO, nt);
+		if (ret){
+			bio->bi_status = errno_to_blk_status(ret);
+			goto out;
+		}
+		trace_ramdisk_segment(dev->gd, direction, sector, bv.bv_len);
+		sector += bv.bv_len >> SECTOR_SHIFT;
+	}
+	if (dev->wb && (bio->bi_opf & REQ_FUA))
+		bio->bi_status = errno_to_blk_status(ram_wb_sync(dev->wb, bio->bi_iter.bi_sector, bytes));
+out:
+	ram_stats_account(&dev->stats, direction ? RS_DIR_WRITE : RS_DIR_READ, bytes, 0, start,
+		bio->bi_status != BLK_STS_OK);
+	trace_ramdisk_complete(dev->gd, bio_op(bio), bio->bi_iter.bi_sector, bytes,
+		blk_status_to_errno(bio->bi_status));
+	bio_endio(bio);
+	return BLK_QC_T_NONE;
+}
+
+/* Bios the block layer merged into this request beyond the first one */
+static unsigned int blkdrv_rq_merges(struct request *req)
+{
+	struct bio *bio;
+	unsigned int nr = 0;
+
+	__rq_for_each_bio(bio, req)
+		nr++;
+	return nr ? nr - 1 : 0;
+}
+
+/* Statistics bucket of a request: a flush has no data but rq_data_dir() calls it a read */
+static int blkdrv_rq_stats_dir(struct request *req)
+{
+	if (req_op(req) == REQ_OP_FLUSH)
+		return RS_DIR_FLUSH;
+	return rq_data_dir(req) ? RS_DIR_WRITE : RS_DIR_READ;
+}
+
+static void blkdrv_complete_rq(Dev *dev, struct request *req, u64 start, blk_status_t sts)
+{
+	ram_stats_account(&dev->stats, blkdrv_rq_stats_dir(req), blk_rq_bytes(req),
+		blkdrv_rq_merges(req), start, sts != BLK_STS_OK);
+	trace_ramdisk_complete(dev->gd, req_op(req), blk_rq_pos(req), blk_rq_bytes(req), blk_status_to_errno(sts));
+	blk_mq_end_request(req, sts);
+}
+
+static enum hrtimer_restart blkdrv_delay_done(struct hrtimer *timer)
+{
+	struct blkdrv_cmd *cmd = container_of(timer, struct blkdrv_cmd, timer);
+	struct request *req = blk_mq_rq_from_pdu(cmd);
+
+	blkdrv_complete_rq(req->q->queuedata, req, cmd->start, cmd->status);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * End a served request, or arm its timer when a delay or bandwidth cap
+ * is injected: the CPU is free meanwhile, as it would be waiting for a
+ * real disk, and the latency statistics include the delay. A request of
+ * a poll queue is left for the submitter to reap in blkdrv_poll(), no
+ * completion softirq or IPI is involved.
+ */
+static void blkdrv_end_rq(Dev *dev, struct request *req, u64 start, blk_status_t sts)
+{
+	struct blkdrv_cmd *cmd = blk_mq_rq_to_pdu(req);
+	u64 delay = ram_fault_delay(&dev->fault, rq_data_dir(req), blk_rq_bytes(req));
+
+	cmd->start = start;
+	cmd->status = sts;
+	if (delay){
+		hrtimer_start(&cmd->timer, ns_to_ktime(delay), HRTIMER_MODE_REL);
+	} else if (req->mq_hctx->type == HCTX_TYPE_POLL){
+		struct blkdrv_queue *bq = req->mq_hctx->driver_data;
+
+		spin_lock(&bq->poll_lock);
+		list_add_tail(&req->queuelist, &bq->poll_list);
+		spin_unlock(&bq->poll_lock);
+	} else
+		blkdrv_complete_rq(dev, req, start, sts);
+}
+
+/*
+ * Copy a read/write request and end it. Returns -ENOMEM, with the
+ * request still owned by the caller, when no backing page could be had
+ * with gfp.
+ */
+static int blkdrv_serve_rq(Dev *dev, struct request *req, u64 start, gfp_t gfp)
+{
 	int ret;
-	while((req = blk_fetch_request(q) ) != NULL){
-		if(req==NULL && req->cmd_type!=REQ_TYPE_FS){
-			pr_err("%s: Request type is not FS(REQ_TYPE_FS) type\n",__func__);
-			__blk_end_request_all(req,-EIO);
+
+	if (req_op(req) == REQ_OP_FLUSH)
+		ret = dev->wb ? ram_wb_flush(dev->wb) : 0;
+	else
+		ret=blkdrv_transfer(dev,req,blk_rq_pos(req),blk_rq_sectors(req),rq_data_dir(req),gfp);
+	if (ret == -ENOMEM)
+		return ret;
+	if (!ret && dev->wb && (req->cmd_flags & REQ_FUA))
+		ret = ram_wb_sync(dev->wb, blk_rq_pos(req), blk_rq_bytes(req));
+	blkdrv_end_rq(dev, req, start, errno_to_blk_status(ret));
+	return 0;
+}
+
+/*
+ * zoned: writes, zone appends and zone management. A write holds its
+ * zone from the write pointer check to the pointer update, so the copy
+ * runs with GFP_NOWAIT and a failed allocation leaves the write pointer
+ * where it was for the requeued retry. An append ends with the sector it
+ * landed on in __sector, which the block layer hands back in the bio.
+ */
+static int blkdrv_zoned_rq(Dev *dev, struct request *req, u64 start)
+{
+	bool append = req_op(req) == REQ_OP_ZONE_APPEND;
+	sector_t sector = blk_rq_pos(req);
+	blk_status_t sts;
+	int ret;
+
+	if (op_is_zone_mgmt(req_op(req))){
+		sts = ram_zone_mgmt(dev->zoned, &dev->store, req_op(req), sector);
+		trace_ramdisk_complete(dev->gd, req_op(req), sector, 0, blk_status_to_errno(sts));
+		blk_mq_end_request(req, sts);
+		return 0;
+	}
+	sts = ram_zone_write_begin(dev->zoned, append, &sector, blk_rq_sectors(req));
+	if (!sts){
+		ret = blkdrv_transfer(dev, req, sector, blk_rq_sectors(req), WRITE, GFP_NOWAIT);
+		ram_zone_write_end(dev->zoned, sector, blk_rq_sectors(req), ret);
+		if (ret == -ENOMEM)
+			return ret;
+		sts = errno_to_blk_status(ret);
+		if (!ret && append)
+			req->__sector = sector;
+	}
+	blkdrv_end_rq(dev, req, start, sts);
+	return 0;
+}
+
+/*
+ * Worker side of async_kb: the memcpy of a large request runs here, on
+ * the submitting CPU's (or node's) worker, and completes the request
+ * from process context. The dispatch path is free again as soon as the
+ * work is queued, so small random I/O isn't stuck behind it.
+ */
+static void blkdrv_async_work(struct work_struct *work)
+{
+	struct blkdrv_cmd *cmd = container_of(work, struct blkdrv_cmd, work);
+	struct request *req = blk_mq_rq_from_pdu(cmd);
+
+	if (blkdrv_serve_rq(req->q->queuedata, req, cmd->start, GFP_NOIO))
+		blk_mq_requeue_request(req, true);
+}
+
+/*
+ * Called by blk-mq on the submitting CPU's hardware context. Nothing is
+ * shared between contexts, so no lock is taken around the copy.
+ */
+static blk_status_t blkdrv_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd){
+	struct request *req = bd->rq;
+	Dev *dev = hctx->queue->queuedata;
+	/* A compressed, deduplicated or cache store sleeps, the tag set is BLK_MQ_F_BLOCKING then */
+	gfp_t gfp = (hctx->flags & BLK_MQ_F_BLOCKING) ? GFP_NOIO : GFP_NOWAIT;
+	/* Latency is measured from request allocation when the block layer stamped it */
+	u64 start = req->start_time_ns ? req->start_time_ns : ktime_get_ns();
+
+	blk_mq_start_request(req);
+	if(blk_rq_is_passthrough(req)){
+		pr_err("%s: Request type is not FS(REQ_OP_READ/WRITE) type\n",__func__);
+		blk_mq_end_request(req, BLK_STS_IOERR);
+		return BLK_STS_OK;
+	}
+	trace_ramdisk_issue(dev->gd, req_op(req), blk_rq_pos(req), blk_rq_bytes(req), 0);
+	if (req_op(req) == REQ_OP_DISCARD || req_op(req) == REQ_OP_WRITE_ZEROES){
+		if (blkdrv_preserve(dev, blk_rq_pos(req), blk_rq_bytes(req), gfp))
+			return BLK_STS_RESOURCE;
+		ram_store_discard(&dev->store, blk_rq_pos(req), blk_rq_bytes(req));
+		ram_stats_account(&dev->stats, RS_DIR_DISCARD, blk_rq_bytes(req), blkdrv_rq_merges(req), start, 0);
+		trace_ramdisk_complete(dev->gd, req_op(req), blk_rq_pos(req), blk_rq_bytes(req), 0);
+		blk_mq_end_request(req, BLK_STS_OK);
+		return BLK_STS_OK;
+	}
+	/* Inline: the zone stays locked across the copy */
+	if (dev->zoned && (req_op(req) == REQ_OP_WRITE || req_op(req) == REQ_OP_ZONE_APPEND ||
+			op_is_zone_mgmt(req_op(req)))){
+		if (blkdrv_zoned_rq(dev, req, start))
+			return BLK_STS_RESOURCE;
+		return BLK_STS_OK;
+	}
+	/* A polled submitter is spinning for this one: no detour through the pool */
+	if (blkdrv_async_wq && hctx->type != HCTX_TYPE_POLL && blk_rq_bytes(req) >= (unsigned int)async_kb * 1024){
+		struct blkdrv_cmd *cmd = blk_mq_rq_to_pdu(req);
+
+		cmd->start = start;
+		INIT_WORK(&cmd->work, blkdrv_async_work);
+		queue_work(blkdrv_async_wq, &cmd->work);
+		return BLK_STS_OK;
+	}
+	if (blkdrv_serve_rq(dev, req, start, gfp))
+		return BLK_STS_RESOURCE;
+	return BLK_STS_OK;
+}
+/* BLKREPORTZONE and blk_revalidate_disk_zones() */
+static int blkdrv_report_zones(struct gendisk *disk, sector_t sector, unsigned int nr_zones,
+		report_zones_cb cb, void *data)
+{
+	Dev *dev = disk->private_data;
+
+	if (!dev->zoned)
+		return -EOPNOTSUPP;
+	return ram_zone_report(dev->zoned, sector, nr_zones, cb, data);
+}
+static int blkdrv_init_request(struct blk_mq_tag_set *set, struct request *req, unsigned int hctx_idx,
+		unsigned int numa_node)
+{
+	struct blkdrv_cmd *cmd = blk_mq_rq_to_pdu(req);
+
+	hrtimer_init(&cmd->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	cmd->timer.function = blkdrv_delay_done;
+	return 0;
+}
+/*
+ * Reap what queue_rq served on this poll queue. Called by the polling
+ * submitter (io_uring IOPOLL, RWF_HIPRI), returns the requests ended.
+ */
+static int blkdrv_poll(struct blk_mq_hw_ctx *hctx)
+{
+	struct blkdrv_queue *bq = hctx->driver_data;
+	struct request *req, *next;
+	LIST_HEAD(list);
+	int nr = 0;
+
+	spin_lock(&bq->poll_lock);
+	list_splice_init(&bq->poll_list, &list);
+	spin_unlock(&bq->poll_lock);
+	list_for_each_entry_safe(req, next, &list, queuelist){
+		struct blkdrv_cmd *cmd = blk_mq_rq_to_pdu(req);
+
+		list_del_init(&req->queuelist);
+		blkdrv_complete_rq(hctx->queue->queuedata, req, cmd->start, cmd->status);
+		nr++;
+	}
+	return nr;
+}
+
+/*
+ * With poll_queues the tag set has a default and a poll map: the first
+ * nr_hw_queues contexts take interrupt style I/O, the rest polled I/O.
+ */
+static int blkdrv_map_queues(struct blk_mq_tag_set *set)
+{
+	unsigned int i, qoff = 0;
+
+	for (i = 0; i < set->nr_maps; i++){
+		struct blk_mq_queue_map *map = &set->map[i];
+
+		switch (i){
+		case HCTX_TYPE_DEFAULT:
+			map->nr_queues = set->nr_hw_queues - (set->nr_maps > HCTX_TYPE_POLL ? poll_queues : 0);
+			break;
+		case HCTX_TYPE_READ:                         /* Reads share the default contexts */
+			map->nr_queues = 0;
 			continue;
+		case HCTX_TYPE_POLL:
+			map->nr_queues = poll_queues;
+			break;
 		}
-		ret=blkdrv_transfer(req,blk_rq_pos(req),blk_rq_sectors(req),dev->buffer,rq_data_dir(req));
-//		ret=blkdrv_transfer(req);
-		__blk_end_request_all(req,ret);
+		map->queue_offset = qoff;
+		qoff += map->nr_queues;
+		blk_mq_map_queues(map);
 	}
+	return 0;
+}
+
+static int blkdrv_init_hctx(struct blk_mq_hw_ctx *hctx, void *data, unsigned int hctx_idx)
+{
+	struct blkdrv_queue *bq;
+
+	bq = kzalloc_node(sizeof(*bq), GFP_KERNEL, hctx->numa_node);
+	if (!bq)
+		return -ENOMEM;
+	spin_lock_init(&bq->poll_lock);
+	INIT_LIST_HEAD(&bq->poll_list);
+	hctx->driver_data = bq;
+	return 0;
+}
+
+static void blkdrv_exit_hctx(struct blk_mq_hw_ctx *hctx, unsigned int hctx_idx)
+{
+	kfree(hctx->driver_data);
+	hctx->driver_data = NULL;
 }
+static const struct blk_mq_ops blkdrv_mq_ops =
+{
+	.queue_rq = blkdrv_queue_rq,
+	.init_request = blkdrv_init_request,
+	.init_hctx = blkdrv_init_hctx,
+	.exit_hctx = blkdrv_exit_hctx,
+	.map_queues = blkdrv_map_queues,
+	.poll = blkdrv_poll,
+};
 static struct block_device_operations blkdrv_fops =
 {
 	.owner = THIS_MODULE,
 	.open = blkdrv_open,
 	.release = blkdrv_close,
 	.getgeo = blkdrv_getgeo,
+	.report_zones = blkdrv_report_zones,
+};
+static struct block_device_operations blkdrv_bio_fops =
+{
+	.owner = THIS_MODULE,
+	.submit_bio = blkdrv_submit_bio,
+	.open = blkdrv_open,
+	.release = blkdrv_close,
+	.getgeo = blkdrv_getgeo,
 };
 	
-static int __init blkdrv_init(void)
+/*
+ * Online resize. Growing only moves the capacity: pages are allocated on
+ * first write anyway. Shrinking is refused with -EBUSY while any page
+ * beyond the new end still holds data; the queue is frozen around the
+ * check so no I/O can land in the tail meanwhile.
+ */
+static int blkdrv_resize(Dev *dev, sector_t new)
 {
-	pr_info("%s: Initialization of Block device driver\n",__func__);
-	dev=kmalloc(sizeof(struct rb_device),GFP_KERNEL);
-	dev->size=DEVICE_SIZE * SECTOR_SIZE;
-	spin_lock_init(&dev->lock);
-	dev->data=vmalloc(dev->size);
-	if(!dev->data){
-		pr_err("%s: Vmalloc allocation failed\n",__func__);
+	sector_t old;
+	int ret = 0;
+
+	if (dev->wb || dev->zoned)                                   /* Sized by the backing device / the zones */
+		return -EOPNOTSUPP;
+	mutex_lock(&dev->resize_lock);
+	old = get_capacity(dev->gd);
+	if (new < old && dev->nr_snaps){                             /* The snapshots read the tail */
+		ret = -EBUSY;
+	} else if (new < old){
+		blk_mq_freeze_queue(dev->Queue);
+		if (!ram_store_range_empty(&dev->store, new, old - new))
+			ret = -EBUSY;
+		else {
+			ram_store_discard(&dev->store, new, (size_t)(old - new) << SECTOR_SHIFT); /* Zero the partial page at the new end */
+			set_capacity_and_notify(dev->gd, new);
+		}
+		blk_mq_unfreeze_queue(dev->Queue);
+	} else if (new > old)
+		set_capacity_and_notify(dev->gd, new);
+	if (!ret)
+		dev->size = (u64)new * SECTOR_SIZE;
+	mutex_unlock(&dev->resize_lock);
+	if (!ret && new != old)
+		pr_info("blk_drv: %s resized from %llu to %llu sectors\n", dev->gd->disk_name,
+			(unsigned long long)old, (unsigned long long)new);
+	return ret;
+}
+
+/*
+ * /sys/block/vdX/ramdisk/size: capacity in 512 byte sectors. The gendisk
+ * already owns a read only "size" file, hence the named group.
+ */
+static ssize_t size_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%llu\n", (unsigned long long)get_capacity(dev_to_disk(d)));
+}
+
+static ssize_t size_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count)
+{
+	Dev *dev = dev_to_disk(d)->private_data;
+	u64 new;
+	int ret;
+
+	ret = kstrtoull(buf, 0, &new);
+	if (ret)
+		return ret;
+	if (!new)
+		return -EINVAL;
+	ret = blkdrv_resize(dev, new);
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(size);
+
+/*
+ * /sys/block/vdX/ramdisk/numa_pages: backing pages per node, in the
+ * "N0=123 N1=456" form of /proc/<pid>/numa_maps.
+ */
+static ssize_t numa_pages_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	Dev *dev = dev_to_disk(d)->private_data;
+	int nid, len = 0;
+
+	for_each_node_state(nid, N_MEMORY)
+		len += sysfs_emit_at(buf, len, "%sN%d=%lu", len ? " " : "", nid,
+			ram_store_node_pages(&dev->store, nid));
+	len += sysfs_emit_at(buf, len, "\n");
+	return len;
+}
+static DEVICE_ATTR_RO(numa_pages);
+
+/*
+ * /sys/block/vdX/ramdisk/comp_stats, only with compress=: what the data
+ * takes before and after compression, the resulting ratio (original
+ * size over memory used) and the CPU time of the compressor.
+ */
+static ssize_t comp_stats_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	Dev *dev = dev_to_disk(d)->private_data;
+	struct ram_comp_stats st;
+	u64 orig, ratio;
+
+	ram_comp_get_stats(&dev->store, &st);
+	orig = st.orig_pages << PAGE_SHIFT;
+	ratio = st.mem_used ? div64_u64(orig * 100, st.mem_used) : 0;
+	return sysfs_emit(buf, "alg=%s orig=%llu compr=%llu mem_used=%llu same_pages=%llu huge_pages=%llu "
+		"ratio=%llu.%02llu comp_ops=%llu comp_ns=%llu decomp_ops=%llu decomp_ns=%llu\n",
+		ram_comp_alg(&dev->store), orig, st.compr_bytes, st.mem_used, st.same_pages, st.huge_pages,
+		ratio / 100, ratio % 100, st.comp_ops, st.comp_ns, st.decomp_ops, st.decomp_ns);
+}
+static DEVICE_ATTR_RO(comp_stats);
+
+/*
+ * /sys/block/vdX/ramdisk/dedup_stats, only with dedup=1: pages written
+ * (logical) against pages of memory (unique) and their ratio, plus how
+ * often a write found its data stored, a hash matched different data
+ * and a partial write had to unshare a page.
+ */
+static ssize_t dedup_stats_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	Dev *dev = dev_to_disk(d)->private_data;
+	struct ram_dedup_stats st;
+	u64 ratio;
+
+	ram_dedup_get_stats(&dev->store, &st);
+	ratio = st.unique_pages ? div64_u64(st.logical_pages * 100, st.unique_pages) : 0;
+	return sysfs_emit(buf, "logical_pages=%llu unique_pages=%llu shared_pages=%llu ratio=%llu.%02llu "
+		"dup_hits=%llu collisions=%llu cow_breaks=%llu\n", st.logical_pages, st.unique_pages,
+		st.shared_pages, ratio / 100, ratio % 100, st.dup_hits, st.collisions, st.cow_breaks);
+}
+static DEVICE_ATTR_RO(dedup_stats);
+
+/* /sys/block/vdX/ramdisk/wb_stats, only with backing_dev= */
+static ssize_t wb_stats_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	Dev *dev = dev_to_disk(d)->private_data;
+	struct ram_wb_stats st;
+
+	ram_wb_get_stats(dev->wb, &st);
+	return sysfs_emit(buf, "dirty_pages=%llu read_hits=%llu read_misses=%llu fills=%llu destaged_pages=%llu "
+		"destage_ios=%llu throttled=%llu errors=%llu evicted=%llu\n", st.dirty_pages, st.read_hits,
+		st.read_misses, st.fills, st.destaged_pages, st.destage_ios, st.throttled, st.errors, st.evicted);
+}
+static DEVICE_ATTR_RO(wb_stats);
+
+/*
+ * /sys/block/vdX/ramdisk/snapshot: writing a file name saves the disk
+ * there right away (in the image= format). I/O waits meanwhile.
+ */
+static ssize_t snapshot_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count)
+{
+	Dev *dev = dev_to_disk(d)->private_data;
+	char *path;
+	int ret;
+
+	if (dev->wb)                                                 /* Not everything is in RAM */
+		return -EOPNOTSUPP;
+	path = kstrndup(buf, count, GFP_KERNEL);
+	if (!path)
+		return -ENOMEM;
+	mutex_lock(&dev->resize_lock);
+	blk_mq_freeze_queue(dev->Queue);
+	ret = ram_image_save(&dev->store, get_capacity(dev->gd), strim(path));
+	blk_mq_unfreeze_queue(dev->Queue);
+	mutex_unlock(&dev->resize_lock);
+	kfree(path);
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_WO(snapshot);
+
+/*
+ * Snapshot disks are bio based and read only: a read walks the snapshot
+ * chain page by page (ram_snap_read()), anything else fails.
+ */
+static blk_qc_t blkdrv_snap_submit_bio(struct bio *bio)
+{
+	struct ram_snap *s = bio->bi_bdev->bd_disk->private_data;
+	Dev *dev = s->private;
+	sector_t sector = bio->bi_iter.bi_sector;
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	u8 *buffer;
+
+	if (bio_op(bio) != REQ_OP_READ || bio_end_sector(bio) > get_capacity(s->gd)){
+		bio->bi_status = BLK_STS_IOERR;
+		bio_endio(bio);
+		return BLK_QC_T_NONE;
+	}
+	bio_for_each_segment(bv, bio, iter){                         /* Single pages, mapped one at a time */
+		buffer = kmap_local_page(bv.bv_page);
+		ram_snap_read(s, &dev->snaps, &dev->store, sector, buffer + bv.bv_offset, bv.bv_len);
+		kunmap_local(buffer);
+		sector += bv.bv_len >> SECTOR_SHIFT;
+	}
+	bio_endio(bio);
+	return BLK_QC_T_NONE;
+}
+
+static const struct block_device_operations blkdrv_snap_fops =
+{
+	.owner = THIS_MODULE,
+	.submit_bio = blkdrv_snap_submit_bio,
+	.getgeo = blkdrv_getgeo,
+};
+
+/*
+ * Take a snapshot of dev as a new read only disk, vdX-snapN. Only the
+ * origin queue is frozen, for as long as it takes to link an empty
+ * snapshot: that is the point in time. Called with resize_lock held.
+ */
+static int blkdrv_snap_create(Dev *dev)
+{
+	struct ram_snap *s;
+	struct gendisk *gd;
+	int ret;
+
+	if (dev->wb || dev->zoned || dev->store.comp)
+		return -EOPNOTSUPP;
+	if (dev->nr_snaps == RB_MAX_SNAPS)
+		return -ENOSPC;
+	s = ram_snap_alloc();
+	if (!s)
 		return -ENOMEM;
+	gd = blk_alloc_disk(NUMA_NO_NODE);
+	if (!gd){
+		ram_snap_free(s);
+		return -ENOMEM;
+	}
+	s->id = ++dev->snap_seq;
+	s->gd = gd;
+	s->private = dev;
+	gd->fops = &blkdrv_snap_fops;
+	gd->private_data = s;                                        /* major 0: dynamic minors */
+	snprintf(gd->disk_name, DISK_NAME_LEN, "%s-snap%u", dev->gd->disk_name, s->id);
+	blk_queue_logical_block_size(gd->queue, SECTOR_SIZE);
+	blk_queue_flag_set(QUEUE_FLAG_NONROT, gd->queue);
+	blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, gd->queue);
+	set_capacity(gd, get_capacity(dev->gd));
+	set_disk_ro(gd, true);
+
+	blk_mq_freeze_queue(dev->Queue);
+	list_add_tail_rcu(&s->node, &dev->snaps);
+	blk_mq_unfreeze_queue(dev->Queue);
+	dev->nr_snaps++;
+
+	ret = device_add_disk(NULL, gd, NULL);
+	if (ret){
+		blk_mq_freeze_queue(dev->Queue);
+		ram_snap_unlink(s, &dev->snaps, GFP_NOIO | __GFP_NOFAIL);
+		blk_mq_unfreeze_queue(dev->Queue);
+		dev->nr_snaps--;
+		synchronize_rcu();
+		blk_cleanup_disk(gd);
+		ram_snap_free(s);
+		return ret;
+	}
+	pr_info("blk_drv: %s: snapshot %s taken\n", dev->gd->disk_name, gd->disk_name);
+	return 0;
+}
+
+/*
+ * Delete a snapshot. Its disk goes first, then the snapshot leaves the
+ * chain: the next older one takes over the pages it relied on. Called
+ * with resize_lock held.
+ */
+static void blkdrv_snap_delete(Dev *dev, struct ram_snap *s)
+{
+	del_gendisk(s->gd);
+	blk_mq_freeze_queue(dev->Queue);                             /* No writer preserves into s meanwhile */
+	ram_snap_unlink(s, &dev->snaps, GFP_NOIO | __GFP_NOFAIL);
+	blk_mq_unfreeze_queue(dev->Queue);
+	dev->nr_snaps--;
+	synchronize_rcu();                                           /* Readers of other snapshots may be in s */
+	pr_info("blk_drv: %s: snapshot %s deleted\n", dev->gd->disk_name, s->gd->disk_name);
+	blk_cleanup_disk(s->gd);
+	ram_snap_free(s);
+}
+
+/* /sys/block/vdX/ramdisk/snap_create: any write takes a snapshot */
+static ssize_t snap_create_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count)
+{
+	Dev *dev = dev_to_disk(d)->private_data;
+	int ret;
+
+	mutex_lock(&dev->resize_lock);
+	ret = blkdrv_snap_create(dev);
+	mutex_unlock(&dev->resize_lock);
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_WO(snap_create);
+
+/* /sys/block/vdX/ramdisk/snap_delete: the N of vdX-snapN to delete */
+static ssize_t snap_delete_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count)
+{
+	Dev *dev = dev_to_disk(d)->private_data;
+	struct ram_snap *s;
+	unsigned int id;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &id);
+	if (ret)
+		return ret;
+	ret = -ENOENT;
+	mutex_lock(&dev->resize_lock);
+	list_for_each_entry(s, &dev->snaps, node){
+		if (s->id == id){
+			blkdrv_snap_delete(dev, s);
+			ret = 0;
+			break;
+		}
+	}
+	mutex_unlock(&dev->resize_lock);
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_WO(snap_delete);
+
+/* /sys/block/vdX/ramdisk/snaps: one line per snapshot, oldest first, with the pages it holds */
+static ssize_t snaps_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	Dev *dev = dev_to_disk(d)->private_data;
+	struct ram_snap *s;
+	int len = 0;
+
+	mutex_lock(&dev->resize_lock);
+	list_for_each_entry(s, &dev->snaps, node)
+		len += sysfs_emit_at(buf, len, "%s pages=%lu\n", s->gd->disk_name, ram_snap_pages(s));
+	mutex_unlock(&dev->resize_lock);
+	return len;
+}
+static DEVICE_ATTR_RO(snaps);
+
+static struct attribute *blkdrv_attrs[] = {
+	&dev_attr_size.attr,
+	&dev_attr_numa_pages.attr,
+	&dev_attr_comp_stats.attr,
+	&dev_attr_dedup_stats.attr,
+	&dev_attr_wb_stats.attr,
+	&dev_attr_snapshot.attr,
+	&dev_attr_snap_create.attr,
+	&dev_attr_snap_delete.attr,
+	&dev_attr_snaps.attr,
+	NULL,
+};
+
+static umode_t blkdrv_attr_visible(struct kobject *kobj, struct attribute *a, int n)
+{
+	Dev *dev = dev_to_disk(kobj_to_dev(kobj))->private_data;
+
+	if (a == &dev_attr_comp_stats.attr && !dev->store.comp)
+		return 0;
+	if (a == &dev_attr_dedup_stats.attr && !dev->store.dedup)
+		return 0;
+	if (a == &dev_attr_wb_stats.attr && !dev->wb)
+		return 0;
+	return a->mode;
+}
+
+static const struct attribute_group blkdrv_attr_grp = {
+	.name = "ramdisk",
+	.attrs = blkdrv_attrs,
+	.is_visible = blkdrv_attr_visible,
+};
+
+static const struct attribute_group *blkdrv_attr_groups[] = {
+	&blkdrv_attr_grp,
+	NULL,
+};
+
+/*
+ * Create and register one disk. Every disk gets MINOR_CNT minors of
+ * the shared major: vda is 0-15, vdb 16-31 and so on.
+ */
+static Dev *blkdrv_alloc(int index, sector_t sectors)
+{
+	bool restored = false, keep;
+	Dev *dev;
+	int ret;
+
+	dev=kzalloc(sizeof(struct rb_device),GFP_KERNEL);
+	if(!dev)
+		return ERR_PTR(-ENOMEM);
+	dev->index = index;
+	dev->size = (u64)sectors * SECTOR_SIZE;
+	mutex_init(&dev->resize_lock);
+	INIT_LIST_HEAD(&dev->snaps);
+	ret = ram_store_init(&dev->store);
+	if (!ret)
+		ret = ram_store_set_numa(&dev->store, numa_mode, numa_node);
+	if (!ret && *compress){
+		char pool[DISK_NAME_LEN];
+
+		snprintf(pool, sizeof(pool), "vd%c", 'a' + index);
+		ret = ram_store_set_compress(&dev->store, compress, pool);
 	}
-	copy_mbr(dev->data);                                         /* Setup its partition table */
+	if (!ret && dedup)
+		ret = ram_store_set_dedup(&dev->store, sectors >> RS_PAGE_SECTORS_SHIFT);
+	if (ret){
+		pr_err("%s: Backing store setup failed (numa_mode %d, numa_node %d, compress %s, dedup %d)\n",__func__,
+			numa_mode,numa_node,*compress ? compress : "off",dedup);
+		goto free_data;
+	}
+	if (index < nr_backing_dev && backing_dev[index] && *backing_dev[index]){
+		struct ram_wb_config cfg = {
+			.dirty_ratio = wb_dirty_ratio,
+			.background_ratio = wb_background_ratio,
+			.interval_ms = wb_interval_ms,
+			.batch_pages = wb_batch_kb > 0 ? wb_batch_kb / (PAGE_SIZE >> 10) : 1,
+			.cache_ratio = wb_cache_ratio,
+		};
+		char name[DISK_NAME_LEN];
+
+		snprintf(name, sizeof(name), "vd%c", 'a' + index);
+		dev->wb = ram_wb_create(&dev->store, backing_dev[index], name, &cfg);
+		if (IS_ERR(dev->wb)){
+			ret = PTR_ERR(dev->wb);
+			dev->wb = NULL;
+			goto free_data;
+		}
+		sectors = ram_wb_capacity(dev->wb);
+		dev->size = (u64)sectors * SECTOR_SIZE;
+	}
+	if (index < nr_image && image[index] && *image[index]){
+		if (dev->wb){
+			pr_err("%s: image= and backing_dev= exclude each other\n",__func__);
+			ret = -EINVAL;
+			goto free_data;
+		}
+		dev->image = image[index];
+		ret = ram_image_load(&dev->store, dev->image, &sectors);
+		if (!ret){
+			restored = true;
+			dev->size = (u64)sectors * SECTOR_SIZE;
+		} else if (ret == -ENOENT){                  /* First load: the image is written at unload */
+			ret = 0;
+		} else {
+			pr_err("%s: Restoring %s failed (%d)\n",__func__,dev->image,ret);
+			goto free_data;
+		}
+	}
+	if (zoned){
+		sector_t zone_sectors = (sector_t)(zone_size_kb > 0 ? zone_size_kb : 0) << 1;
+
+		if (zone_nr > 0)
+			sectors = zone_sectors * zone_nr;
+		dev->zoned = ram_zone_create(sectors, zone_sectors, zone_nr_conv > 0 ? zone_nr_conv : 0,
+			zone_max_open > 0 ? zone_max_open : 0, zone_max_active > 0 ? zone_max_active : 0);
+		if (IS_ERR(dev->zoned)){
+			ret = PTR_ERR(dev->zoned);
+			dev->zoned = NULL;
+			goto free_data;
+		}
+		sectors = ram_zone_capacity(dev->zoned);
+		dev->size = (u64)sectors * SECTOR_SIZE;
+	}
+	/*
+	 * part_layout builds a table for the actual size. Without it the static
+	 * tables describe a DEVICE_SIZE disk, a smaller one is left blank. A
+	 * cache uses the backing device's table, a restored disk brought its own.
+	 * A host managed zoned disk can't be partitioned.
+	 */
+	keep = dev->wb || restored || dev->zoned;
+	if (!keep && *part_layout){
+		ret = ram_part_write(&dev->store, sectors, SECTOR_SIZE, part_layout,
+			part_align_kb > 0 ? part_align_kb << 10 : SECTOR_SIZE);
+	} else if (!keep && sectors >= DEVICE_SIZE){
+		ret = copy_mbr(&dev->store);                         /* Setup its partition table */
 #if BR
-	copy_br_partition_data(dev->data);
+		if (!ret)
+			ret = copy_br_partition_data(&dev->store);
 #endif
-	/* Get a request queue (here queue is created) */
-	dev->Queue = blk_init_queue(blkdrv_request, &dev->lock);
-	if (!dev->Queue){
-		pr_err("blk_init_queue: Queue Initialization Failed\n");
-		vfree(dev->data);
-		return -ENOMEM;
 	}
-	/*allocation of Request queue for request processing */
-	blk_queue_logical_block_size(dev->Queue,SECTOR_SIZE);
-	/* Get Registered */
-	majornumber = register_blkdev(majornumber, "blk_drv");
-	if (majornumber <= 0){
-		pr_err("%s: BLOCK device registeration failed\n",__func__);
-		vfree(dev->data);
-		return -EBUSY;
+	if (ret){
+		pr_err("%s: Partition table allocation failed\n",__func__);
+		goto free_data;
 	}
-	pr_info("Registered: Driver Registered with %d Major number\n",majornumber);
+	if (queue_mode == RB_Q_BIO){
+		dev->gd = blk_alloc_disk(numa_mode == RS_NUMA_BIND ? numa_node : NUMA_NO_NODE);
+		if (!dev->gd){
+			pr_err("GENDISK: blk_alloc_disk Allocation failed\n");
+			ret = -ENOMEM;
+			goto free_data;
+		}
+		dev->gd->fops = &blkdrv_bio_fops;
+	} else {
+		/*
+		 * Tag set: one hardware context per CPU by default, so submitters on
+		 * different CPUs never meet on a common queue lock.
+		 */
+		dev->tag_set.ops = &blkdrv_mq_ops;
+		dev->tag_set.nr_hw_queues = nr_hw_queues > 0 ? nr_hw_queues : nr_cpu_ids;
+		/* The poll queues come on top, blk-mq then sets QUEUE_FLAG_POLL */
+		if (poll_queues > 0){
+			dev->tag_set.nr_maps = HCTX_MAX_TYPES;
+			dev->tag_set.nr_hw_queues += poll_queues;
+		}
+		dev->tag_set.queue_depth = queue_depth > 0 ? queue_depth : 128;
+		/* Keep tags and hctx structures next to the data when bound to a node */
+		dev->tag_set.numa_node = numa_mode == RS_NUMA_BIND ? numa_node : NUMA_NO_NODE;
+		dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+		if (dev->store.comp || dev->store.dedup || dev->wb)
+			dev->tag_set.flags |= BLK_MQ_F_BLOCKING;
+		dev->tag_set.cmd_size = sizeof(struct blkdrv_cmd);
+		dev->tag_set.driver_data = dev;
+		ret = blk_mq_alloc_tag_set(&dev->tag_set);
+		if (ret){
+			pr_err("blk_mq_alloc_tag_set: Tag set allocation failed\n");
+			goto free_data;
+		}
+		/*
+		 * Add the gendisk structure (here queue is created as well)
+		 * By using this memory allocation is involved, 
+		 * the minor number we need to pass bcz the device 
+		 * will support this much partitions 
+		 */
+		dev->gd = blk_mq_alloc_disk(&dev->tag_set, dev);
+		if (IS_ERR(dev->gd)){
+			pr_err("GENDISK: blk_mq_alloc_disk Allocation failed\n");
+			ret = PTR_ERR(dev->gd);
+			goto free_tags;
+		}
+		dev->gd->fops = &blkdrv_fops;
+	}
+	dev->Queue = dev->gd->queue;
+	blk_queue_logical_block_size(dev->Queue,SECTOR_SIZE);
 	/*
-	 * Add the gendisk structure
-	 * By using this memory allocation is involved, 
-	 * the minor number we need to pass bcz the device 
-	 * will support this much partitions 
+	 * Nothing is DMAed: a segment may be any number of pages and a request
+	 * any number of segments, only its total size is bounded.
 	 */
-	dev->gd = alloc_disk(MINOR_CNT);
-	if (!dev->gd){
-		pr_err("GENDISK: alloc_disc Allocation failed\n");
-		blk_cleanup_queue(dev->Queue);
-		unregister_blkdev(majornumber, "blk_drv");
-		vfree(dev->data);
-		return -ENOMEM;
+	blk_queue_max_segment_size(dev->Queue, UINT_MAX);
+	blk_queue_max_segments(dev->Queue, USHRT_MAX);
+	blk_queue_max_hw_sectors(dev->Queue, max_sectors_kb > 0 ? max_sectors_kb << 1 : BLK_SAFE_MAX_SECTORS);
+	blk_queue_flag_set(QUEUE_FLAG_NONROT, dev->Queue);          /* No seek penalty, no entropy from timings */
+	blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, dev->Queue);
+	/*
+	 * Discard and write zeroes hand the backing pages back to the system.
+	 * A cache offers neither (a dropped page would read back from the
+	 * backing device) but has a volatile write cache to flush. A zoned disk
+	 * offers neither: data only goes away with a zone reset.
+	 */
+	if (dev->wb)
+		blk_queue_write_cache(dev->Queue, true, true);
+	else if (!dev->zoned)
+		blk_queue_max_write_zeroes_sectors(dev->Queue, UINT_MAX);
+	if (!dev->wb && !dev->zoned){
+		dev->Queue->limits.discard_granularity = PAGE_SIZE;
+		blk_queue_max_discard_sectors(dev->Queue, UINT_MAX);
+		blk_queue_flag_set(QUEUE_FLAG_DISCARD, dev->Queue);
 	}
 	dev->gd->major = majornumber;
-	dev->gd->first_minor = FIRST_MINOR;
-	dev->gd->fops = &blkdrv_fops;
-	dev->gd->private_data = &dev;
-	dev->gd->queue = dev->Queue;
+	dev->gd->first_minor = FIRST_MINOR + index * MINOR_CNT;
+	dev->gd->minors = MINOR_CNT;
+	dev->gd->private_data = dev;
 	/*
 	 * You do not want partition information to show up in 
 	 * cat /proc/partitions set this flags
 	 */
 	//rb_dev.gd->flags = GENHD_FL_SUPPRESS_PARTITION_INFO;
-	sprintf(dev->gd->disk_name, "vd");
-	set_capacity(dev->gd, DEVICE_SIZE);
-	add_disk(dev->gd);
-	pr_info("blk_drv: Ram Block driver initialised (%d sectors; %d bytes)\n",
-		DEVICE_SIZE, dev->size );
+	sprintf(dev->gd->disk_name, "vd%c", 'a' + index);
+	set_capacity(dev->gd, sectors);
+	/* Before add_disk(): the partition scan is already I/O */
+	ret = ram_stats_init(&dev->stats, dev->gd->disk_name, blkdrv_debugfs);
+	if (ret)
+		goto cleanup_disk;
+	ram_fault_init(&dev->fault, dev->stats.dir);
+	if (dev->zoned){
+		/* Zones are reported through fops, the capacity must be set already */
+		blk_queue_set_zoned(dev->gd, BLK_ZONED_HM);
+		blk_queue_flag_set(QUEUE_FLAG_ZONE_RESETALL, dev->Queue);
+		blk_queue_required_elevator_features(dev->Queue, ELEVATOR_F_ZBD_SEQ_WRITE);
+		ret = blk_revalidate_disk_zones(dev->gd, NULL);
+		if (ret)
+			goto free_stats;
+		blk_queue_max_zone_append_sectors(dev->Queue, dev->Queue->limits.chunk_sectors);
+		blk_queue_max_open_zones(dev->Queue, zone_max_open > 0 ? zone_max_open : 0);
+		blk_queue_max_active_zones(dev->Queue, zone_max_active > 0 ? zone_max_active : 0);
+	}
+	ret = device_add_disk(NULL, dev->gd, blkdrv_attr_groups);
+	if (ret)
+		goto free_stats;
+	pr_info("blk_drv: %s initialised (%llu sectors; %llu bytes; %s, %u hw queues, %d polled)\n",
+		dev->gd->disk_name, (unsigned long long)sectors, dev->size,
+		queue_mode == RB_Q_BIO ? "bio" : "blk-mq", dev->tag_set.nr_hw_queues,
+		queue_mode != RB_Q_BIO && poll_queues > 0 ? poll_queues : 0);
+	return dev;
+
+free_stats:
+	ram_stats_exit(&dev->stats);
+	ram_fault_exit(&dev->fault);
+cleanup_disk:
+	blk_cleanup_disk(dev->gd);
+free_tags:
+	if (queue_mode != RB_Q_BIO)
+		blk_mq_free_tag_set(&dev->tag_set);
+free_data:
+	if (dev->zoned)
+		ram_zone_destroy(dev->zoned);
+	if (dev->wb)
+		ram_wb_destroy(dev->wb);
+	ram_store_free(&dev->store);
+	kfree(dev);
+	return ERR_PTR(ret);
+}
+
+/* Teardown: the origin is gone already, so nothing is preserved or inherited anymore */
+static void blkdrv_snap_delete_all(Dev *dev)
+{
+	struct ram_snap *s, *next;
+
+	list_for_each_entry(s, &dev->snaps, node)
+		del_gendisk(s->gd);
+	list_for_each_entry_safe(s, next, &dev->snaps, node){
+		list_del(&s->node);
+		blk_cleanup_disk(s->gd);
+		ram_snap_free(s);
+	}
+	dev->nr_snaps = 0;
+}
+
+static void blkdrv_free(Dev *dev)
+{
+	del_gendisk(dev->gd);
+	blkdrv_snap_delete_all(dev);
+	/* No I/O anymore: the image is consistent */
+	if (dev->image && ram_image_save(&dev->store, dev->size >> SECTOR_SHIFT, dev->image))
+		pr_err("blk_drv: %s: saving %s failed, the disk contents are lost\n",dev->gd->disk_name,dev->image);
+	blk_cleanup_disk(dev->gd);
+	if (queue_mode != RB_Q_BIO)
+		blk_mq_free_tag_set(&dev->tag_set);
+	ram_stats_exit(&dev->stats);
+	ram_fault_exit(&dev->fault);
+	if (dev->wb)
+		ram_wb_destroy(dev->wb);                             /* Destage whatever is still dirty */
+	if (dev->zoned)
+		ram_zone_destroy(dev->zoned);
+	ram_store_free(&dev->store);
+	kfree(dev);
+}
+
+static int __init blkdrv_init(void)
+{
+	sector_t sectors;
+	int ret, i = 0;
 
+	pr_info("%s: Initialization of Block device driver\n",__func__);
+	if (rd_nr < 1 || rd_nr > RB_MAX_DEVICES){
+		pr_err("%s: rd_nr must be between 1 and %d\n",__func__,RB_MAX_DEVICES);
+		return -EINVAL;
+	}
+	/* The zone locks are spinlocks held across the copy: nothing that sleeps */
+	if (zoned && (queue_mode == RB_Q_BIO || *compress || nr_backing_dev || nr_image)){
+		pr_err("%s: zoned needs queue_mode=1 and excludes compress, backing_dev and image\n",__func__);
+		return -EINVAL;
+	}
+	if (dedup && (*compress || nr_backing_dev)){
+		pr_err("%s: dedup excludes compress and backing_dev\n",__func__);
+		return -EINVAL;
+	}
+	/* Bio based polling only arrived with 5.16 */
+	if (poll_queues > 0 && queue_mode == RB_Q_BIO){
+		pr_err("%s: poll_queues needs queue_mode=1\n",__func__);
+		return -EINVAL;
+	}
+	/* Get Registered */
+	ret = register_blkdev(majornumber, "blk_drv");
+	if (ret < 0){
+		pr_err("%s: BLOCK device registeration failed\n",__func__);
+		return ret;
+	}
+	if (!majornumber)
+		majornumber = ret;
+	pr_info("Registered: Driver Registered with %d Major number\n",majornumber);
+	blkdrv_debugfs = debugfs_create_dir("vd", NULL);
+	if (async_kb > 0 && queue_mode != RB_Q_BIO){
+		/*
+		 * Bound: a work item runs on the CPU that queued it. Unbound: on
+		 * any CPU of the submitter's NUMA node. WQ_MEM_RECLAIM since this
+		 * is block I/O and must make progress under memory pressure.
+		 */
+		blkdrv_async_wq = alloc_workqueue("vd_async", WQ_MEM_RECLAIM | (async_unbound ? WQ_UNBOUND : 0), 0);
+		if (!blkdrv_async_wq){
+			ret = -ENOMEM;
+			goto free_devices;
+		}
+	}
+	for (i = 0; i < rd_nr; i++){
+		sectors = (i < nr_nsector && nsector[i] > 0) ? nsector[i] : DEVICE_SIZE;
+		devices[i] = blkdrv_alloc(i, sectors);
+		if (IS_ERR(devices[i])){
+			ret = PTR_ERR(devices[i]);
+			devices[i] = NULL;
+			goto free_devices;
+		}
+	}
 	return 0;
+
+free_devices:
+	while (--i >= 0)
+		blkdrv_free(devices[i]);
+	if (blkdrv_async_wq)
+		destroy_workqueue(blkdrv_async_wq);
+	debugfs_remove_recursive(blkdrv_debugfs);
+	unregister_blkdev(majornumber, "blk_drv");
+	return ret;
 }
 /*
  * This is the unregistration and uninitialization section of the ram block
@@ -244,11 +1420,14 @@ static int __init blkdrv_init(void)
  */
 static void __exit blkdrv_cleanup(void)
 {
-	del_gendisk(dev->gd);
-	put_disk(dev->gd);
-	blk_cleanup_queue(dev->Queue);
+	int i;
+
+	for (i = 0; i < rd_nr; i++)
+		blkdrv_free(devices[i]);
+	if (blkdrv_async_wq)
+		destroy_workqueue(blkdrv_async_wq);
+	debugfs_remove_recursive(blkdrv_debugfs);
 	unregister_blkdev(majornumber, "blk_drv");
-	vfree(dev->data);
 }
 
 module_init(blkdrv_init);